@@ -4,7 +4,8 @@
  ****************************************************************************/
 #include "CCComicView.h"
 #include "CCScopedClock.h"
-#include "network/HttpClient.h"
+#include "CCURLTextureCache.h"
+#include "CCImageUtil.h"
 #include <unistd.h>
 
 NS_CC_EXT_BEGIN
@@ -22,9 +23,19 @@ ComicView::Attribute::Attribute()
 , edgeSize(128)
 , relationSeconds(0.0f)
 , touchMoveAdjustmentThreshold(0.2f)
+, workerThreads(0)
+, compressedCacheBytes(8 * 1024 * 1024)
+, decodedCacheBytes(16 * 1024 * 1024)
+, textureCacheBytes(24 * 1024 * 1024)
+, fitToView(true)
+, uploadTimePerFrame(0.004f)
 {}
 
 
+/// テクスチャへ1度に転送するデータ量の目安
+static const int32_t UPLOAD_STRIP_BYTES = 256 * 1024;
+
+
 #pragma mark -- PageData
 
 ComicView::PageData::~PageData(){
@@ -45,55 +56,125 @@ void ComicView::PageData::flipData(){
 }
 
 
-#pragma mark -- ThreadSafeQueue
+#pragma mark -- RingQueue
 
 template <class T>
-void ComicView::ThreadSafeQueue<T>::push(T component){
-    _mutex.lock();
-    _queue.push_back(component);
-    _mutex.unlock();
-    _sleepCondition.notify_one();
-}
+ComicView::RingQueue<T>::RingQueue()
+: _mask(0)
+, _pushPos(0)
+, _popPos(0)
+, _waiters(0)
+{}
 
 template <class T>
-T ComicView::ThreadSafeQueue<T>::pop(){
-    std::lock_guard<std::mutex> _(_mutex);
-    if( !_queue.empty() ){
-        auto component = _queue.front();
-        _queue.pop_front();
-        return component;
+void ComicView::RingQueue<T>::reserve(size_t capacity){
+    size_t size = 2;
+    while( size < capacity ){
+        size <<= 1;
     }
-    return nullptr;
+    _cells.reset(new Cell[size]);
+    for( size_t lp = 0; lp < size; ++lp ){
+        _cells[lp].sequence.store(lp, std::memory_order_relaxed);
+    }
+    _mask = size - 1;
+    _pushPos.store(0, std::memory_order_relaxed);
+    _popPos.store(0, std::memory_order_relaxed);
 }
 
 template <class T>
-T ComicView::ThreadSafeQueue<T>::pop_wait(){
-    while( empty() ){// take measures against spurious wakeup
-        _sleepCondition.wait(_sleepMutex);
+void ComicView::RingQueue<T>::push(T component){
+    waitUntil([this, component](){ return tryPush(component); });
+    wakeUp();
+}
+
+template <class T>
+T ComicView::RingQueue<T>::pop(){
+    T component = nullptr;
+    if( tryPop(component) ){
+        wakeUp();
     }
-    std::lock_guard<std::mutex> _(_mutex);
-    auto component = _queue.front();
-    _queue.pop_front();
     return component;
 }
 
 template <class T>
-bool ComicView::ThreadSafeQueue<T>::empty() const {
-    std::lock_guard<std::mutex> _(_mutex);
-    return _queue.empty();
+T ComicView::RingQueue<T>::pop_wait(){
+    T component = nullptr;
+    waitUntil([this, &component](){ return tryPop(component); });
+    wakeUp();
+    return component;
+}
+
+template <class T>
+bool ComicView::RingQueue<T>::tryPush(T component){
+    // 各セルの sequence は、push できる周回で位置と等しく、pop できる周回で位置+1 になる
+    size_t pos = _pushPos.load(std::memory_order_relaxed);
+    for(;;){
+        Cell& cell = _cells[pos & _mask];
+        const size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        const intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+        if( diff == 0 ){
+            if( _pushPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed) ){
+                cell.component = component;
+                cell.sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        }else if( diff < 0 ){
+            // 満杯
+            return false;
+        }else{
+            pos = _pushPos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+template <class T>
+bool ComicView::RingQueue<T>::tryPop(T& component){
+    size_t pos = _popPos.load(std::memory_order_relaxed);
+    for(;;){
+        Cell& cell = _cells[pos & _mask];
+        const size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        const intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+        if( diff == 0 ){
+            if( _popPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed) ){
+                component = cell.component;
+                cell.sequence.store(pos + _mask + 1, std::memory_order_release);
+                return true;
+            }
+        }else if( diff < 0 ){
+            // 空
+            return false;
+        }else{
+            pos = _popPos.load(std::memory_order_relaxed);
+        }
+    }
 }
 
 template <class T>
-bool ComicView::ThreadSafeQueue<T>::exists(T component) const {
-    std::lock_guard<std::mutex> _(_mutex);
-    const auto it = std::find(_queue.begin(), _queue.end(), component);
-    return it != _queue.end();
+template <class F>
+void ComicView::RingQueue<T>::waitUntil(const F& done){
+    while( !done() ){
+        std::unique_lock<std::mutex> lock(_sleepMutex);
+        // 待つことを知らせてから確かめ直し、wakeUp との間で取りこぼさないようにする
+        _waiters.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const bool succeeded = done();
+        if( !succeeded ){
+            _sleepCondition.wait(lock);
+        }
+        _waiters.fetch_sub(1);
+        if( succeeded ){
+            return;
+        }
+    }
 }
 
 template <class T>
-int32_t ComicView::ThreadSafeQueue<T>::size() const {
-    std::lock_guard<std::mutex> _(_mutex);
-    return  static_cast<int32_t>(_queue.size());
+void ComicView::RingQueue<T>::wakeUp(){
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if( _waiters.load(std::memory_order_relaxed) > 0 ){
+        std::lock_guard<std::mutex> _(_sleepMutex);
+        _sleepCondition.notify_all();
+    }
 }
 
 
@@ -116,16 +197,34 @@ ComicView::ComicView()
 , _adjustment(false)
 , _inertiaEnabled(false)
 , _touching(false)
+, _loadingPageIndex(-1)
+, _loadingDirection(1)
+, _loadingStopped(false)
+, _decodeWidth(0)
+, _decodeHeight(0)
+, _lowMemoryEvent(nullptr)
 {}
 
 ComicView::~ComicView(){
-    if( _pageFileThread.joinable() ){
-        _pageFileQueue.push(nullptr);
-        _pageFileThread.join();
+    if( _lowMemoryEvent ){
+        getEventDispatcher()->removeEventListener(_lowMemoryEvent);
+    }
+    // 破棄された後にダウンロードが完了しないようにする
+    for( auto& pageData : _pageDatas ){
+        if( pageData.downloadId != 0 ){
+            URLDownloader::getInstance()->cancel(pageData.downloadId);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> _(_loadingMutex);
+        _loadingStopped = true;
+    }
+    _loadingCondition.notify_all();
+    for( auto& thread : _workerThreads ){
+        thread.join();
     }
-    if( _pageImageThread.joinable() ){
-        _pageImageQueue.push(nullptr);
-        _pageImageThread.join();
+    for( auto& upload : _pageUploads ){
+        CC_SAFE_RELEASE(upload.texture);
     }
 }
 
@@ -139,51 +238,15 @@ bool ComicView::initWithAttribute(std::unique_ptr<Attribute> attribute){
         _attribute->cacheDir.push_back('/');
     }
     
-    //
-    _pageFileThread = std::thread([this](){
-        while( auto p = _pageFileQueue.pop_wait() ){
-            if( p->data.empty() ){
-                FILE* fp = fopen(p->storagePath.c_str(), "rb");
-                fseek(fp, 0, SEEK_END);
-                p->data.resize(ftell(fp));
-                fseek(fp, 0, SEEK_SET);
-                fread(p->data.data(), p->data.size(), 1, fp);
-                fclose(fp);
-                if( p->http ){
-                    p->flipData();
-                }
-            }else{
-                p->flipData();
-                FILE* fp = fopen(p->storagePath.c_str(), "wb");
-                fwrite(p->data.data(), p->data.size(), 1, fp);
-                fclose(fp);
-                p->flipData();
-            }
-            p->loading = false;
-            p->initializing = true;
-            _pageImageQueue.push(p);
-        }
-    });
+    // 各ページは同じキューに1つまでしか積まないので、ページ数があれば足りる
+    _pageImageReadyQueue.reserve(_attribute->urlList.size());
     
-    //
-    _pageImageThread = std::thread([this](){
-        while( auto p = _pageImageQueue.pop_wait() ){
-            CC_SCOPED_CLODK("***** LoadImage");
-            if( p->loading ){
-                p->initializing = false;
-            }else{
-                if( !p->image ){
-                    p->image = new (std::nothrow) Image();
-                    p->image->initWithImageData((unsigned char*)p->data.data(), p->data.size());
-                }
-                p->initializing = false;
-                _pageImageReadyQueue.push(p);
-            }
-        }
-    });
+    _cacheLimits[CACHE_COMPRESSED] = _attribute->compressedCacheBytes;
+    _cacheLimits[CACHE_DECODED] = _attribute->decodedCacheBytes;
+    _cacheLimits[CACHE_TEXTURE] = _attribute->textureCacheBytes;
     
-    //
-    _pageDatas.resize(_attribute->urlList.size());
+    // PageData はコピーできないので、要素を移動せずに作り直す
+    _pageDatas = std::vector<PageData>(_attribute->urlList.size());
     for( int lp = 0; lp < _pageDatas.size(); ++lp ){
         auto& pageData = _pageDatas[lp];
         pageData.index = lp;
@@ -192,6 +255,8 @@ bool ComicView::initWithAttribute(std::unique_ptr<Attribute> attribute){
         pageData.initializing = false;
         pageData.image = nullptr;
         pageData.texture = nullptr;
+        pageData.queued = 0;
+        pageData.downloadId = 0;
         
         pageData.http = (pageData.url.find("http") != std::string::npos);
         if( pageData.http ){
@@ -201,6 +266,27 @@ bool ComicView::initWithAttribute(std::unique_ptr<Attribute> attribute){
         }
     }
     
+    // ワーカーは _pageDatas を参照するので、ページ情報を作ってから起動する
+    // ファイルの読み書きとデコードは、ページが違えば並行して行われる
+    int32_t numThreads = _attribute->workerThreads;
+    if( numThreads <= 0 ){
+        numThreads = std::max(1, static_cast<int32_t>(std::thread::hardware_concurrency()) - 1);
+    }
+    for( int32_t lp = 0; lp < numThreads; ++lp ){
+        _workerThreads.emplace_back([this](){
+            PageData::Queued flag;
+            while( auto p = popPage(flag) ){
+                if( flag == PageData::QUEUED_FILE ){
+                    loadPageFile(*p);
+                }else{
+                    loadPageImage(*p);
+                }
+                // 処理中に積まれた分は、このワーカーが次に取り出す
+                p->unmarkQueued(PageData::WORKING);
+            }
+        });
+    }
+    
     //
     _pageViews.resize(_attribute->cacheRange * 2 + 1);
     for( int lp = 0; lp < _pageViews.size(); ++lp ){
@@ -358,6 +444,11 @@ bool ComicView::initWithAttribute(std::unique_ptr<Attribute> attribute){
     getEventDispatcher()->addEventListenerWithSceneGraphPriority(touch, this);
     _touchEvent = touch;
     
+    // シーンに配置されていない間もキャッシュを持っているので、常に受け取る
+    _lowMemoryEvent = getEventDispatcher()->addCustomEventListener(EVENT_LOW_MEMORY, [this](EventCustom*){
+        shrinkCache();
+    });
+    
     return true;
 }
 
@@ -445,21 +536,15 @@ void ComicView::update(float delta){
         }
     }
     
-    // 別スレッドで読み込んだイメージからテクスチャを作成し、表示対象があれば適用する
+    // 別スレッドで読み込んだイメージは、転送を終えるまで QUEUED_READY の印を残しておく
     while( auto pageData = _pageImageReadyQueue.pop() ){
-        
-        auto it = std::find_if(_pageViews.begin(), _pageViews.end(), [pageData](const PageView& pageView){
-            return pageData->index == pageView.index;
-        });
-        if( it == _pageViews.end() ){
-            // 対象がいなくなっているので削除
-            pageData->clear();
-        }else{
-            it->sprite->setVisible(true);
-            it->loadingNode->setVisible(false);
-            updatePage(*it, *pageData);
-        }
+        PageUpload upload;
+        upload.pageData = pageData;
+        upload.texture = nullptr;
+        upload.uploadedRows = 0;
+        _pageUploads.push_back(upload);
     }
+    uploadPages();
     
     //
     updateSpritePosition();
@@ -468,6 +553,13 @@ void ComicView::update(float delta){
 void ComicView::setContentSize(const Size& contentSize){
     Node::setContentSize(contentSize);
     
+    // 既にデコードしたページは、そのままの大きさで拡大縮小して表示する
+    if( _attribute->fitToView ){
+        const float scale = Director::getInstance()->getContentScaleFactor();
+        _decodeWidth = static_cast<int32_t>(ceilf(contentSize.width * scale));
+        _decodeHeight = static_cast<int32_t>(ceilf(contentSize.height * scale));
+    }
+    
     if( _attribute->direction == Direction::Horizontal ){
         _pageSize = getContentSize().width;
     }else{
@@ -507,21 +599,123 @@ std::string ComicView::makePath(const std::string& url) const {
 }
 
 void ComicView::startDownload(PageData& pageData){
-    auto request = new (std::nothrow) network::HttpRequest();
-    request->setRequestType(network::HttpRequest::Type::GET);
-    request->setUrl(pageData.url);
-    request->setResponseCallback([this, &pageData](network::HttpClient* client, network::HttpResponse* response){
+    // 優先度は setPage で、表示位置に合わせて変更する
+    pageData.downloadId = URLDownloader::getInstance()->request(pageData.url, getDownloadPriority(pageData.index), [this, &pageData](network::HttpResponse* response){
+        pageData.downloadId = 0;
         if( response->isSucceed() ){
             pageData.data = std::move(*response->getResponseData());
             // ストレージへ保存
-            _pageFileQueue.push(&pageData);
+            pushPage(pageData, PageData::QUEUED_FILE);
         }else{
             //TODO: retry
             CCLOG("ERROR[%ld] %s", response->getResponseCode(), response->getErrorBuffer());
         }
     });
-    network::HttpClient::getInstance()->send(request);
-    request->release();
+}
+
+URLDownloader::Priority ComicView::getDownloadPriority(int32_t index) const {
+    const int32_t distance = std::abs(index - _pageIndex);
+    if( distance == 0 ){
+        return URLDownloader::Priority::Visible;
+    }
+    if( distance == 1 ){
+        return URLDownloader::Priority::NearVisible;
+    }
+    return URLDownloader::Priority::Prefetch;
+}
+
+void ComicView::pushPage(PageData& pageData, PageData::Queued flag){
+    if( pageData.markQueued(flag) ){
+        // 待っているワーカーが印を見落とさないように、ロックしてから起こす
+        std::lock_guard<std::mutex> _(_loadingMutex);
+        _loadingCondition.notify_all();
+    }
+}
+
+ComicView::PageData* ComicView::popPage(PageData::Queued& outFlag){
+    for(;;){
+        if( auto pageData = takePage(outFlag) ){
+            return pageData;
+        }
+        std::unique_lock<std::mutex> lock(_loadingMutex);
+        if( _loadingStopped ){
+            return nullptr;
+        }
+        if( auto pageData = takePage(outFlag) ){
+            return pageData;
+        }
+        _loadingCondition.wait(lock);
+    }
+}
+
+ComicView::PageData* ComicView::takePage(PageData::Queued& outFlag){
+    // 現在のページから近い順に、同じ距離であれば進んでいる方向を先に探す
+    // キャッシュ範囲の外にあるページは、範囲に戻るまで取り出さない
+    const int32_t center = _loadingPageIndex;
+    const int32_t direction = _loadingDirection;
+    const int32_t numPages = static_cast<int32_t>(_pageDatas.size());
+    for( int32_t distance = 0; distance <= _attribute->cacheRange; ++distance ){
+        for( const int32_t index : {center + distance * direction, center - distance * direction} ){
+            if( index >= 0 && index < numPages ){
+                PageData& pageData = _pageDatas[index];
+                // 他のワーカーが処理しているページは飛ばす
+                if( (pageData.queued & (PageData::QUEUED_FILE | PageData::QUEUED_IMAGE)) && pageData.markQueued(PageData::WORKING) ){
+                    for( const auto flag : {PageData::QUEUED_FILE, PageData::QUEUED_IMAGE} ){
+                        if( pageData.unmarkQueued(flag) ){
+                            outFlag = flag;
+                            return &pageData;
+                        }
+                    }
+                    pageData.unmarkQueued(PageData::WORKING);
+                }
+            }
+            if( distance == 0 ){
+                break;
+            }
+        }
+    }
+    return nullptr;
+}
+
+void ComicView::loadPageFile(PageData& pageData){
+    if( pageData.data.empty() ){
+        FILE* fp = fopen(pageData.storagePath.c_str(), "rb");
+        fseek(fp, 0, SEEK_END);
+        pageData.data.resize(ftell(fp));
+        fseek(fp, 0, SEEK_SET);
+        fread(pageData.data.data(), pageData.data.size(), 1, fp);
+        fclose(fp);
+        if( pageData.http ){
+            pageData.flipData();
+        }
+    }else{
+        pageData.flipData();
+        FILE* fp = fopen(pageData.storagePath.c_str(), "wb");
+        fwrite(pageData.data.data(), pageData.data.size(), 1, fp);
+        fclose(fp);
+        pageData.flipData();
+    }
+    pageData.loading = false;
+    pageData.initializing = true;
+    pushPage(pageData, PageData::QUEUED_IMAGE);
+}
+
+void ComicView::loadPageImage(PageData& pageData){
+    CC_SCOPED_CLODK("***** LoadImage");
+    if( pageData.loading ){
+        pageData.initializing = false;
+    }else{
+        if( !pageData.image ){
+            // 表示サイズより大きなページは、ここで縮小しておく
+            pageData.image = imageutil::decode((unsigned char*)pageData.data.data(), pageData.data.size(), _decodeWidth, _decodeHeight);
+        }
+        pageData.initializing = false;
+        if( !pageData.image ){
+            CCLOG("ERROR: failed to decode %s", pageData.url.c_str());
+        }else if( pageData.markQueued(PageData::QUEUED_READY) ){
+            _pageImageReadyQueue.push(&pageData);
+        }
+    }
 }
 
 void ComicView::updateSpritePosition(){
@@ -542,13 +736,6 @@ void ComicView::updateSpritePosition(){
 }
 
 void ComicView::updatePage(PageView& pageView, PageData& pageData){
-    
-    if( !pageData.texture ){
-        pageData.texture = new (std::nothrow) Texture2D();
-        CC_SCOPED_CLODK("***** updatePage");
-        pageData.texture->initWithImage(pageData.image, Texture2D::PixelFormat::RGB888);
-        CCLOG("*TexGen: %s", pageData.url.c_str());
-    }
     pageView.sprite->setTexture(pageData.texture);
     
     const Size size = pageView.sprite->getTexture()->getContentSize();
@@ -566,7 +753,15 @@ void ComicView::setPage(int32_t page){
     const int32_t newPageIndex = std::max(0, std::min<int32_t>(page, (int)_pageDatas.size() - 1));
     if( _pageIndex == newPageIndex )
         return;
+    
+    // 読み込みの優先順位を、新しいページと進んだ方向に合わせる
+    _loadingDirection = (newPageIndex < _pageIndex)? -1 : 1;
     _pageIndex = newPageIndex;
+    {
+        std::lock_guard<std::mutex> _(_loadingMutex);
+        _loadingPageIndex = _pageIndex;
+    }
+    _loadingCondition.notify_all();
     
     if( _pageIndex == 0 || _pageIndex+1 == _pageDatas.size() ){
         _adjustmentTargetOffset = 0;
@@ -586,25 +781,43 @@ void ComicView::setPage(int32_t page){
         if( pageView.index >= 0 && pageView.index < _pageDatas.size() ){
             auto& pageData = _pageDatas[pageView.index];
             
-            const bool ready( !pageData.initializing && pageData.image );
+            const bool ready( pageData.texture != nullptr );
             if( ready ){
                 pageView.sprite->setVisible(true);
                 pageView.loadingNode->setVisible(false);
                 updatePage(pageView, pageData);
             }else{
-                if( pageData.data.empty() ){
-                    if( !pageData.loading ){
+                const uint32_t loadingFlags = PageData::QUEUED_FILE | PageData::QUEUED_IMAGE | PageData::QUEUED_READY | PageData::WORKING;
+                if( (pageData.queued & loadingFlags) == 0 && pageData.image ){
+                    // キャッシュに残っていたイメージを、他のページと同じく分割して転送する
+                    pageData.markQueued(PageData::QUEUED_READY);
+                    PageUpload upload;
+                    upload.pageData = &pageData;
+                    upload.texture = nullptr;
+                    upload.uploadedRows = 0;
+                    _pageUploads.push_back(upload);
+                }else if( pageData.queued & PageData::QUEUED_READY ){
+                    // 転送を待っている
+                }else if( pageData.data.empty() ){
+                    if( pageData.downloadId != 0 ){
+                        URLDownloader::getInstance()->setPriority(pageData.downloadId, getDownloadPriority(pageData.index));
+                    }else if( !pageData.loading ){
                         pageData.loading = true;
                         if( FileUtils::getInstance()->isFileExist(pageData.storagePath) ){
-                            _pageFileQueue.push(&pageData);
+                            pushPage(pageData, PageData::QUEUED_FILE);
                         }else{
                             startDownload(pageData);
                         }
                     }
+                }else if( pageData.loading ){
+                    // ダウンロードしたデータの保存が取り消されていれば、保存からやり直す
+                    if( !(pageData.queued & PageData::WORKING) ){
+                        pushPage(pageData, PageData::QUEUED_FILE);
+                    }
                 }else{
-                    if( !_pageImageQueue.exists(&pageData) ){
+                    if( !(pageData.queued & PageData::QUEUED_IMAGE) ){
                         pageData.initializing = true;
-                        _pageImageQueue.push(&pageData);
+                        pushPage(pageData, PageData::QUEUED_IMAGE);
                     }
                 }
                 
@@ -630,12 +843,32 @@ void ComicView::setPage(int32_t page){
     }
     
     for( const int32_t lostIndex : lostIndices ){
-        // 対象がいなくなっているのでグラフィックリソースを削除
+        // グラフィックリソースは trimCache で、遠いページから解放する
         if( lostIndex < _pageDatas.size() ){
-            _pageDatas[lostIndex].clear();
+            auto& pageData = _pageDatas[lostIndex];
+            // ダウンロードは取り消し (送信済みであれば結果を捨てる)、範囲に戻った時にやり直す
+            if( pageData.downloadId != 0 ){
+                URLDownloader::getInstance()->cancel(pageData.downloadId);
+                pageData.downloadId = 0;
+                pageData.loading = false;
+            }
+            // ワーカーはキャッシュ範囲の外のページを取り出さないので、まだ始まっていない読み込みを取り消す
+            // 印が残ると trimCache で解放できなくなる。WORKING の印を取ってから外し、ワーカーと競合しないようにする
+            if( pageData.markQueued(PageData::WORKING) ){
+                if( pageData.unmarkQueued(PageData::QUEUED_FILE) && pageData.data.empty() ){
+                    // ダウンロードしたデータの保存であれば loading のままにして、範囲に戻った時に保存し直す
+                    pageData.loading = false;
+                }
+                if( pageData.unmarkQueued(PageData::QUEUED_IMAGE) ){
+                    pageData.initializing = false;
+                }
+                pageData.unmarkQueued(PageData::WORKING);
+            }
         }
     }
     
+    trimCache();
+    
     if( _attribute->onUpdatePageIndex ){
         _attribute->onUpdatePageIndex(this);
     }
@@ -643,6 +876,187 @@ void ComicView::setPage(int32_t page){
     updateSpritePosition();
 }
 
+int32_t ComicView::getPageOrder(int32_t index) const {
+    const int32_t offset = index - _pageIndex;
+    return std::abs(offset) * 2 + ((offset * _loadingDirection < 0)? 1 : 0);
+}
+
+void ComicView::uploadPages(){
+    if( _pageUploads.empty() ){
+        return;
+    }
+    // 予算を使い切るまで、現在のページに近いものから帯に分けて転送する (少なくとも1つの帯は転送する)
+    const auto start = std::chrono::steady_clock::now();
+    const auto budget = std::chrono::duration<float>(_attribute->uploadTimePerFrame);
+    bool uploaded = false;
+    do {
+        auto it = std::min_element(_pageUploads.begin(), _pageUploads.end(), [this](const PageUpload& a, const PageUpload& b){
+            return getPageOrder(a.pageData->index) < getPageOrder(b.pageData->index);
+        });
+        PageData& pageData = *it->pageData;
+        if( std::abs(pageData.index - _pageIndex) > _attribute->cacheRange ){
+            // 表示範囲から外れたページは転送をやめる (イメージはキャッシュに残る)
+            CC_SAFE_RELEASE(it->texture);
+            _pageUploads.erase(it);
+            pageData.unmarkQueued(PageData::QUEUED_READY);
+            continue;
+        }
+        if( !uploadStrip(*it) ){
+            continue;
+        }
+        
+        pageData.texture = it->texture;
+#if CC_ENABLE_CACHE_TEXTURE_DATA
+        // コンテキストを失った時に作り直せるように登録する
+        // イメージは VolatileTextureMgr が保持するので、キャッシュから解放されても残る
+        VolatileTextureMgr::addImage(pageData.texture, pageData.image);
+#endif
+        _pageUploads.erase(it);
+        pageData.unmarkQueued(PageData::QUEUED_READY);
+        CCLOG("*TexGen: %s", pageData.url.c_str());
+        uploaded = true;
+        
+        auto view = std::find_if(_pageViews.begin(), _pageViews.end(), [&pageData](const PageView& pageView){
+            return pageData.index == pageView.index;
+        });
+        if( view != _pageViews.end() ){
+            view->sprite->setVisible(true);
+            view->loadingNode->setVisible(false);
+            updatePage(*view, pageData);
+        }
+    } while( !_pageUploads.empty() && std::chrono::steady_clock::now() - start < budget );
+    
+    if( uploaded ){
+        trimCache();
+    }
+}
+
+bool ComicView::uploadStrip(PageUpload& upload){
+    Image* image = upload.pageData->image;
+    const auto format = image->getRenderFormat();
+    const int32_t width = image->getWidth();
+    const int32_t height = image->getHeight();
+    
+    // 分割できない形式は、まとめて転送する
+    if( (format != Texture2D::PixelFormat::RGBA8888 && format != Texture2D::PixelFormat::RGB888) || image->isCompressed() || image->getNumberOfMipmaps() > 1 ){
+        upload.texture = new (std::nothrow) Texture2D();
+        upload.texture->initWithImage(image, Texture2D::PixelFormat::RGB888);
+        return true;
+    }
+    
+    // 最初の帯を転送する前に、RGB888のテクスチャを確保しておく
+    if( !upload.texture ){
+        upload.texture = new (std::nothrow) Texture2D();
+        upload.texture->initWithData(nullptr, width * height * 3, Texture2D::PixelFormat::RGB888, width, height, Size(width, height));
+    }
+    
+    const int32_t rows = std::min(height - upload.uploadedRows, std::max(1, UPLOAD_STRIP_BYTES / (width * 3)));
+    const unsigned char* pixels = image->getData();
+    if( format == Texture2D::PixelFormat::RGBA8888 ){
+        // ページは不透明なので、アルファを落とす
+        _uploadBuffer.resize(width * rows * 3);
+        const unsigned char* src = pixels + static_cast<size_t>(upload.uploadedRows) * width * 4;
+        for( int32_t lp = 0; lp < width * rows; ++lp ){
+            _uploadBuffer[lp * 3 + 0] = src[lp * 4 + 0];
+            _uploadBuffer[lp * 3 + 1] = src[lp * 4 + 1];
+            _uploadBuffer[lp * 3 + 2] = src[lp * 4 + 2];
+        }
+        pixels = _uploadBuffer.data();
+    }else{
+        pixels += static_cast<size_t>(upload.uploadedRows) * width * 3;
+    }
+    // RGB888 の行は4バイト境界に揃わない (他の転送に影響しないように元に戻す)
+    GLint alignment = 4;
+    glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    upload.texture->updateWithData(pixels, 0, upload.uploadedRows, width, rows);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+    upload.uploadedRows += rows;
+    return upload.uploadedRows >= height;
+}
+
+void ComicView::shrinkCache(float ratio){
+    for( auto& limit : _cacheLimits ){
+        limit = static_cast<size_t>(limit * ratio);
+    }
+    trimCache();
+}
+
+void ComicView::resetCacheLimits(){
+    _cacheLimits[CACHE_COMPRESSED] = _attribute->compressedCacheBytes;
+    _cacheLimits[CACHE_DECODED] = _attribute->decodedCacheBytes;
+    _cacheLimits[CACHE_TEXTURE] = _attribute->textureCacheBytes;
+    trimCache();
+}
+
+size_t ComicView::getCacheBytes(const PageData& pageData, CacheTier tier){
+    switch( tier ){
+        case CACHE_COMPRESSED:
+            return pageData.data.capacity();
+        case CACHE_DECODED:
+            return pageData.image? static_cast<size_t>(pageData.image->getDataLen()) : 0;
+        case CACHE_TEXTURE:
+            return pageData.texture? URLTextureCache::getTextureBytes(pageData.texture) : 0;
+        default:
+            return 0;
+    }
+}
+
+void ComicView::trimCache(){
+    // ワーカーが触れるのは印の付いたページだけなので、印の無いページはGLスレッドから解放できる
+    // 読み込み中のページは数えない
+    std::vector<PageData*> pages;
+    std::array<size_t, NUM_CACHE_TIERS> bytes = {};
+    for( auto& pageData : _pageDatas ){
+        if( pageData.queued != 0 ){
+            continue;
+        }
+        bool cached = false;
+        for( int32_t tier = 0; tier < NUM_CACHE_TIERS; ++tier ){
+            const size_t size = getCacheBytes(pageData, static_cast<CacheTier>(tier));
+            bytes[tier] += size;
+            cached |= (size > 0);
+        }
+        if( cached ){
+            pages.push_back(&pageData);
+        }
+    }
+    
+    // 遠いページから、同じ距離であれば進んでいる方向の逆から解放する
+    std::sort(pages.begin(), pages.end(), [this](const PageData* a, const PageData* b){
+        return getPageOrder(a->index) > getPageOrder(b->index);
+    });
+    
+    for( int32_t tier = 0; tier < NUM_CACHE_TIERS; ++tier ){
+        for( auto it = pages.begin(); it != pages.end() && bytes[tier] > _cacheLimits[tier]; ++it ){
+            PageData& pageData = **it;
+            const size_t size = getCacheBytes(pageData, static_cast<CacheTier>(tier));
+            if( size == 0 ){
+                continue;
+            }
+            switch( tier ){
+                case CACHE_COMPRESSED:
+                    // ストレージから読み直せる (保存を取り消されたデータであれば、ダウンロードし直す)
+                    std::vector<char>().swap(pageData.data);
+                    pageData.loading = false;
+                    break;
+                case CACHE_DECODED:
+                    CC_SAFE_RELEASE_NULL(pageData.image);
+                    break;
+                case CACHE_TEXTURE:
+                    // 表示範囲のテクスチャは、上限を超えても残す
+                    if( std::abs(pageData.index - _pageIndex) <= _attribute->cacheRange ){
+                        continue;
+                    }
+                    CC_SAFE_RELEASE_NULL(pageData.texture);
+                    break;
+            }
+            bytes[tier] -= size;
+            CCLOG("*Evict[%d]: %s", tier, pageData.url.c_str());
+        }
+    }
+}
+
 #if COCOS2D_DEBUG > 0
 ComicView* createComicViewSample(const std::vector<std::string>& urlList, bool vertical, bool adjust){
     auto labelPage = cocos2d::Label::createWithSystemFont("", "Helvetica", 32);
@@ -7,9 +7,22 @@
 
 #include <cocos2d.h>
 #include "ExtensionMacros.h"
+#include "CCURLDownloader.h"
 #include <array>
+#include <atomic>
 
 
+/**
+ * メモリ不足の警告を受けた時に、アプリから送るイベント
+ * ComicView はこのイベントを受け取ると shrinkCache を呼ぶ
+ @code
+ Director::getInstance()->getEventDispatcher()->dispatchCustomEvent(EVENT_LOW_MEMORY);
+ @endcode
+ */
+#ifndef EVENT_LOW_MEMORY
+#define EVENT_LOW_MEMORY "event_low_memory"
+#endif
+
 NS_CC_EXT_BEGIN
 
 /**
@@ -61,6 +74,18 @@ public:
         float relationSeconds;
         /// TouchMoveでの自動送り判定の閾値 (0.0 - 1.0)
         float touchMoveAdjustmentThreshold;
+        /// ページを読み込むスレッドの数 (0 であればコア数から1を引いた数)
+        int32_t workerThreads;
+        /// 圧縮されたままのページデータをメモリに残す上限 (bytes) (default: 8MB)
+        size_t compressedCacheBytes;
+        /// デコードしたイメージをメモリに残す上限 (bytes) (default: 16MB)
+        size_t decodedCacheBytes;
+        /// テクスチャを残す上限 (bytes) (default: 24MB)。前後 cacheRange 以内のページは上限を超えても残す
+        size_t textureCacheBytes;
+        /// ページをビューのピクセル数に収まるように縮小してデコードする (default: true)。ストレージの元画像はそのまま
+        bool fitToView;
+        /// 1フレームでテクスチャの転送に使う時間 (秒)。大きなページは帯に分けて、複数のフレームで転送する
+        float uploadTimePerFrame;
         
         /// 閲覧ページの変更通知
         std::function<void(ComicView* sender)> onUpdatePageIndex;
@@ -114,30 +139,69 @@ public:
         setPage(_pageIndex + add);
     }
     
+    /**
+     * 各段階のキャッシュの上限を ratio 倍にして、超えた分を解放する
+     * EVENT_LOW_MEMORY を受け取った時に呼ばれる。resetCacheLimits で Attribute の設定に戻す
+     */
+    void shrinkCache(float ratio = 0.5f);
+    void resetCacheLimits();
+    
 private:
     
     /**
-     * スレッドセーフなキュー
+     * 容量が固定された、スレッドセーフなキュー
+     * 複数のスレッドから push / pop でき、ロックを取るのは空か満杯で待つ時だけ
      */
     template <class T>
-    struct ThreadSafeQueue {
-        std::list<T> _queue;
-        mutable std::mutex _mutex;
-        std::mutex _sleepMutex;
-        std::condition_variable_any _sleepCondition;
+    class RingQueue {
+    public:
+        RingQueue();
         
+        /// 容量を確保する (2の累乗に切り上げる)。使い始める前に呼ぶこと
+        void reserve(size_t capacity);
+        /// 満杯であれば pop されるまで待つ
         void push(T component);
+        /// 空であれば nullptr
         T pop();
+        /// 空であれば push されるまで待つ
         T pop_wait();
-        bool empty() const;
-        bool exists(T component) const;
-        int32_t size() const;
+    
+    private:
+        struct Cell {
+            std::atomic<size_t> sequence;
+            T component;
+        };
+        
+        bool tryPush(T component);
+        bool tryPop(T& component);
+        template <class F>
+        void waitUntil(const F& done);
+        void wakeUp();
+        
+        std::unique_ptr<Cell[]> _cells;
+        size_t _mask;
+        /// push と pop の位置は、別のキャッシュラインに置く
+        std::atomic<size_t> _pushPos;
+        char _padding[64];
+        std::atomic<size_t> _popPos;
+        std::atomic<int32_t> _waiters;
+        std::mutex _sleepMutex;
+        std::condition_variable _sleepCondition;
     };
     
     /**
      * ページ情報
      */
     struct PageData {
+        /// 積まれているキューと、ワーカーの処理状態
+        enum Queued : uint32_t {
+            QUEUED_FILE = 1 << 0,
+            QUEUED_IMAGE = 1 << 1,
+            QUEUED_READY = 1 << 2,
+            /// いずれかのワーカーが処理している
+            WORKING = 1 << 3,
+        };
+        
         int32_t index;
         std::string url;
         std::string storagePath;
@@ -147,15 +211,47 @@ private:
         bool http;
         Image* image;
         Texture2D* texture;
+        /// QUEUED_FILE と QUEUED_IMAGE は、ワーカーが現在のページに近いものから取り出す
+        std::atomic<uint32_t> queued;
+        /// ダウンロード中のリクエスト (無ければ 0)
+        URLDownloader::RequestId downloadId;
         
         ~PageData();
         
+        /// 印が付いていなければ付けて true を返す
+        inline bool markQueued(Queued flag){ return (queued.fetch_or(flag) & flag) == 0; }
+        /// 印が付いていれば外して true を返す
+        inline bool unmarkQueued(Queued flag){ return (queued.fetch_and(~flag) & flag) != 0; }
+        
         /// グラフィックリソースの削除
         void clear();
         /// 先頭8bytesをビット反転して、OSのビューワー等でそのままでは見れないようにする
         void flipData();
     };
     
+    /**
+     * キャッシュの段階
+     */
+    enum CacheTier {
+        /// 圧縮されたままのデータ (PageData::data)
+        CACHE_COMPRESSED,
+        /// デコードしたイメージ (PageData::image)
+        CACHE_DECODED,
+        /// テクスチャ (PageData::texture)
+        CACHE_TEXTURE,
+        NUM_CACHE_TIERS,
+    };
+    
+    /**
+     * テクスチャへ転送中のページ
+     */
+    struct PageUpload {
+        PageData* pageData;
+        /// 最初の帯を転送する時に確保する
+        Texture2D* texture;
+        int32_t uploadedRows;
+    };
+    
     /**
      * ページ表示情報
      */
@@ -170,13 +266,24 @@ private:
     
     std::vector<PageView> _pageViews;
     std::vector<PageData> _pageDatas;
-    std::thread _pageFileThread;
-    std::thread _pageImageThread;
-    ThreadSafeQueue<PageData*> _pageFileQueue;
-    ThreadSafeQueue<PageData*> _pageImageQueue;
-    ThreadSafeQueue<PageData*> _pageImageReadyQueue;
+    std::vector<std::thread> _workerThreads;
+    RingQueue<PageData*> _pageImageReadyQueue;
+    std::vector<PageUpload> _pageUploads;
+    std::vector<unsigned char> _uploadBuffer;
+    /// ワーカーが読み込みの優先順位を決める基準 (_pageIndex と進んだ方向)
+    std::atomic<int32_t> _loadingPageIndex;
+    std::atomic<int32_t> _loadingDirection;
+    std::mutex _loadingMutex;
+    std::condition_variable _loadingCondition;
+    bool _loadingStopped;
+    /// CacheTier 毎の上限 (bytes)
+    std::array<size_t, NUM_CACHE_TIERS> _cacheLimits;
+    /// ワーカーがデコードする最大のピクセル数 (0 であれば縮小しない)
+    std::atomic<int32_t> _decodeWidth;
+    std::atomic<int32_t> _decodeHeight;
     
     EventListener* _touchEvent;
+    EventListenerCustom* _lowMemoryEvent;
     
     int32_t _pageIndex;
     bool _inertiaEnabled;
@@ -192,7 +299,25 @@ private:
     
     std::string makePath(const std::string& url) const;
     void startDownload(PageData& pageData);
+    URLDownloader::Priority getDownloadPriority(int32_t index) const;
+    /// ワーカーへ読み込みを要求する
+    void pushPage(PageData& pageData, PageData::Queued flag);
+    /// 要求されたページを優先順に取り出し、WORKING の印を付ける。無ければ待ち、終了する時は nullptr
+    PageData* popPage(PageData::Queued& outFlag);
+    PageData* takePage(PageData::Queued& outFlag);
+    /// ストレージから読み込むか、ダウンロードしたデータを保存する
+    void loadPageFile(PageData& pageData);
+    void loadPageImage(PageData& pageData);
     void updatePage(PageView& pageView, PageData& pageData);
+    /// 解放や転送の順 (現在のページに近く、進んでいる方向にあるほど小さい)
+    int32_t getPageOrder(int32_t index) const;
+    /// uploadTimePerFrame の間、現在のページに近いものから転送する
+    void uploadPages();
+    /// 次の帯を転送する。最後の帯を転送したら true
+    bool uploadStrip(PageUpload& upload);
+    static size_t getCacheBytes(const PageData& pageData, CacheTier tier);
+    /// 上限を超えた段階のキャッシュを、現在のページから遠いものから解放する
+    void trimCache();
     void updateSpritePosition();
 };
 
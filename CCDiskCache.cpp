@@ -0,0 +1,393 @@
+/****************************************************************************
+ Copyright (c) Yassy
+ https://github.com/yassy0413/cocos2dx-3.x-util
+ ****************************************************************************/
+#include "CCDiskCache.h"
+#include <ctime>
+#include <dirent.h>
+
+NS_CC_EXT_BEGIN
+
+namespace {
+    const char* INDEX_FILENAME = "index";
+    const int64_t DEFAULT_CAPACITY = 64 * 1024 * 1024;
+    /// 以前の LazySprite が base64 で "http://" と "https://" を名前にしていたディレクトリ
+    const char* LEGACY_DIR_PREFIXES[] = { "aHR0cDovL", "aHR0cHM6Ly" };
+    
+    /// 環境に依存しない64bitハッシュ (FNV-1a)
+    uint64_t hashKey(const std::string& key){
+        uint64_t hash = 14695981039346656037ULL;
+        for( const char c : key ){
+            hash ^= static_cast<unsigned char>(c);
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+    
+    int64_t now(){
+        return static_cast<int64_t>(time(nullptr));
+    }
+    
+    /// インデックスの区切りになるタブと改行を、キーに含められるようにエスケープする
+    std::string escapeKey(const std::string& key){
+        std::string escaped;
+        escaped.reserve(key.size());
+        for( const char c : key ){
+            switch( c ){
+                case '\\': escaped += "\\\\"; break;
+                case '\t': escaped += "\\t"; break;
+                case '\n': escaped += "\\n"; break;
+                default: escaped.push_back(c); break;
+            }
+        }
+        return escaped;
+    }
+    
+    std::string unescapeKey(const std::string& escaped){
+        std::string key;
+        key.reserve(escaped.size());
+        for( size_t lp = 0; lp < escaped.size(); ++lp ){
+            if( escaped[lp] != '\\' || lp + 1 == escaped.size() ){
+                key.push_back(escaped[lp]);
+                continue;
+            }
+            switch( escaped[++lp] ){
+                case 't': key.push_back('\t'); break;
+                case 'n': key.push_back('\n'); break;
+                default: key.push_back(escaped[lp]); break;
+            }
+        }
+        return key;
+    }
+}
+
+typedef std::unordered_map<std::string, DiskCache*> DiskCacheList;
+static DiskCacheList* s_diskCaches = nullptr;
+
+DiskCache* DiskCache::getInstance(const std::string& cachePath){
+    if( !s_diskCaches ){
+        s_diskCaches = new (std::nothrow) DiskCacheList();
+    }
+    std::string rootDir = FileUtils::getInstance()->getWritablePath() + cachePath;
+    if( rootDir.empty() || *rootDir.rbegin() != '/' ){
+        rootDir.push_back('/');
+    }
+    auto it = s_diskCaches->find(rootDir);
+    if( it == s_diskCaches->end() ){
+        it = s_diskCaches->emplace(rootDir, new (std::nothrow) DiskCache(rootDir)).first;
+    }
+    return it->second;
+}
+
+void DiskCache::destroyInstance(){
+    if( s_diskCaches ){
+        for( auto& it : *s_diskCaches ){
+            delete it.second;
+        }
+        CC_SAFE_DELETE(s_diskCaches);
+    }
+}
+
+DiskCache::DiskCache(const std::string& rootDir)
+: _rootDir(rootDir)
+, _indexPath(rootDir + INDEX_FILENAME)
+, _size(0)
+, _capacity(DEFAULT_CAPACITY)
+, _dirty(false)
+, _trimming(false)
+, _numPendingTasks(0)
+{
+    FileUtils::getInstance()->createDirectory(_rootDir);
+    loadIndex();
+    
+    // 強制終了されても最終アクセス時刻を失わないように、バックグラウンドへ移る時に保存する
+    _backgroundListener = Director::getInstance()->getEventDispatcher()->addCustomEventListener(EVENT_COME_TO_BACKGROUND, [this](EventCustom*){
+        flush();
+    });
+    enqueueTask([this](){
+        removeLegacyFiles();
+    });
+}
+
+DiskCache::~DiskCache(){
+    Director::getInstance()->getEventDispatcher()->removeEventListener(_backgroundListener);
+    {
+        std::unique_lock<std::mutex> lock(_taskMutex);
+        _taskCondition.wait(lock, [this](){ return _numPendingTasks == 0; });
+    }
+    saveIndex();
+}
+
+void DiskCache::enqueueTask(const std::function<void()>& task){
+    {
+        std::lock_guard<std::mutex> _(_taskMutex);
+        ++_numPendingTasks;
+    }
+    AsyncTaskPool::getInstance()->enqueue(AsyncTaskPool::TaskType::TASK_IO, [](void*){}, nullptr, [this, task](){
+        task();
+        // 通知するまでロックを持っておき、待っているデストラクタより先に抜ける
+        std::lock_guard<std::mutex> _(_taskMutex);
+        --_numPendingTasks;
+        _taskCondition.notify_all();
+    });
+}
+
+void DiskCache::setCapacity(int64_t bytes){
+    {
+        std::lock_guard<std::mutex> _(_mutex);
+        _capacity = bytes;
+    }
+    requestTrim();
+}
+
+int64_t DiskCache::getCapacity() const {
+    std::lock_guard<std::mutex> _(_mutex);
+    return _capacity;
+}
+
+int64_t DiskCache::getSize() const {
+    std::lock_guard<std::mutex> _(_mutex);
+    return _size;
+}
+
+std::string DiskCache::lookup(const std::string& key){
+    std::lock_guard<std::mutex> _(_mutex);
+    auto it = _entries.find(key);
+    if( it == _entries.end() ){
+        return "";
+    }
+    it->second.lastAccess = now();
+    _dirty = true;
+    return _rootDir + makeRelativePath(key);
+}
+
+bool DiskCache::exists(const std::string& key) const {
+    std::lock_guard<std::mutex> _(_mutex);
+    return _entries.find(key) != _entries.end();
+}
+
+std::string DiskCache::makePath(const std::string& key) const {
+    return _rootDir + makeRelativePath(key);
+}
+
+std::string DiskCache::makeRelativePath(const std::string& key) const {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(hashKey(key)));
+    return std::string(buf, 2) + "/" + buf;
+}
+
+bool DiskCache::write(const std::string& key, const void* data, size_t size, const std::string& metadata){
+    CC_ASSERT( metadata.find('\n') == std::string::npos );
+    const std::string path = makePath(key);
+    const std::string tmpPath = path + ".tmp";
+    
+    // 書き込み途中のファイルがキャッシュとして扱われないように、一時ファイルを経由する
+    FileUtils::getInstance()->createDirectory(path.substr(0, path.rfind('/')));
+    FILE* file = fopen(tmpPath.c_str(), "wb");
+    if( !file ){
+        return false;
+    }
+    const bool succeeded = (fwrite(data, size, 1, file) == 1 || size == 0);
+    fclose(file);
+    if( !succeeded || rename(tmpPath.c_str(), path.c_str()) != 0 ){
+        ::remove(tmpPath.c_str());
+        return false;
+    }
+    
+    {
+        std::lock_guard<std::mutex> _(_mutex);
+        auto it = _entries.find(key);
+        if( it != _entries.end() ){
+            _size -= it->second.size;
+        }
+        Entry& entry = _entries[key];
+        entry.size = static_cast<int64_t>(size);
+        entry.lastAccess = now();
+        entry.metadata = metadata;
+        _size += entry.size;
+        _dirty = true;
+    }
+    requestTrim();
+    return true;
+}
+
+std::string DiskCache::getMetadata(const std::string& key) const {
+    std::lock_guard<std::mutex> _(_mutex);
+    auto it = _entries.find(key);
+    return (it != _entries.end())? it->second.metadata : "";
+}
+
+void DiskCache::setMetadata(const std::string& key, const std::string& metadata){
+    CC_ASSERT( metadata.find('\n') == std::string::npos );
+    std::lock_guard<std::mutex> _(_mutex);
+    auto it = _entries.find(key);
+    if( it != _entries.end() && it->second.metadata != metadata ){
+        it->second.metadata = metadata;
+        _dirty = true;
+    }
+}
+
+void DiskCache::remove(const std::string& key){
+    {
+        std::lock_guard<std::mutex> _(_mutex);
+        auto it = _entries.find(key);
+        if( it == _entries.end() ){
+            return;
+        }
+        _size -= it->second.size;
+        _entries.erase(it);
+        _dirty = true;
+    }
+    ::remove(makePath(key).c_str());
+}
+
+void DiskCache::clear(){
+    std::vector<std::string> keys;
+    {
+        std::lock_guard<std::mutex> _(_mutex);
+        keys.reserve(_entries.size());
+        for( const auto& it : _entries ){
+            keys.push_back(it.first);
+        }
+    }
+    for( const auto& key : keys ){
+        remove(key);
+    }
+    saveIndex();
+}
+
+void DiskCache::flush(){
+    enqueueTask([this](){
+        saveIndex();
+    });
+}
+
+void DiskCache::loadIndex(){
+    // 1行に [最終アクセス時刻] [サイズ] [キー] [付随する情報] をタブ区切りで記録している
+    // キーのタブと改行はエスケープしている。付随する情報は省略されることがあり、タブを含むこともある
+    FILE* file = fopen(_indexPath.c_str(), "rb");
+    if( !file ){
+        return;
+    }
+    std::string line;
+    for( int c = fgetc(file); c != EOF; c = fgetc(file) ){
+        if( c != '\n' ){
+            line.push_back(static_cast<char>(c));
+            continue;
+        }
+        const auto sep1 = line.find('\t');
+        const auto sep2 = (sep1 == std::string::npos)? sep1 : line.find('\t', sep1+1);
+        if( sep2 != std::string::npos ){
+            Entry entry;
+            entry.lastAccess = strtoll(line.c_str(), nullptr, 10);
+            entry.size = strtoll(line.c_str() + sep1 + 1, nullptr, 10);
+            const auto sep3 = line.find('\t', sep2+1);
+            if( sep3 != std::string::npos ){
+                entry.metadata = line.substr(sep3+1);
+            }
+            _entries[unescapeKey(line.substr(sep2+1, sep3 - (sep2+1)))] = entry;
+            _size += entry.size;
+        }
+        line.clear();
+    }
+    fclose(file);
+}
+
+void DiskCache::saveIndex(){
+    std::string text;
+    {
+        std::lock_guard<std::mutex> _(_mutex);
+        if( !_dirty ){
+            return;
+        }
+        _dirty = false;
+        for( const auto& it : _entries ){
+            text += StringUtils::format("%lld\t%lld\t", static_cast<long long>(it.second.lastAccess), static_cast<long long>(it.second.size));
+            text += escapeKey(it.first);
+            if( !it.second.metadata.empty() ){
+                text.push_back('\t');
+                text += it.second.metadata;
+            }
+            text.push_back('\n');
+        }
+    }
+    std::lock_guard<std::mutex> _(_indexMutex);
+    const std::string tmpPath = _indexPath + ".tmp";
+    FILE* file = fopen(tmpPath.c_str(), "wb");
+    if( file ){
+        fwrite(text.data(), text.size(), 1, file);
+        fclose(file);
+        rename(tmpPath.c_str(), _indexPath.c_str());
+    }
+}
+
+void DiskCache::requestTrim(){
+    // 削除タスクは同時に1つだけ積む
+    if( _trimming.exchange(true) ){
+        return;
+    }
+    enqueueTask([this](){
+        trim();
+        saveIndex();
+        _trimming = false;
+        // trim してから印を外すまでの間に書き込まれた分は、ここで拾う
+        if( getSize() > getCapacity() ){
+            requestTrim();
+        }
+    });
+}
+
+void DiskCache::removeLegacyFiles(){
+    // 以前の LazySprite はURLのドメイン部分を base64 にしたディレクトリへ保存していた
+    // インデックスに載らず容量の制限も受けないので、見つけたら削除する
+    std::vector<std::string> dirs;
+    if( DIR* dir = opendir(_rootDir.c_str()) ){
+        for( dirent* entry = readdir(dir); entry != NULL; entry = readdir(dir) ){
+            for( const char* prefix : LEGACY_DIR_PREFIXES ){
+                if( strncmp(entry->d_name, prefix, strlen(prefix)) == 0 ){
+                    dirs.push_back(_rootDir + entry->d_name + "/");
+                    break;
+                }
+            }
+        }
+        closedir(dir);
+    }
+    for( const auto& path : dirs ){
+        FileUtils::getInstance()->removeDirectory(path);
+        CCLOG("DiskCache remove legacy [%s]", path.c_str());
+    }
+}
+
+void DiskCache::trim(){
+    std::vector<std::pair<int64_t, std::string>> victims;
+    {
+        std::lock_guard<std::mutex> _(_mutex);
+        if( _size <= _capacity ){
+            return;
+        }
+        std::vector<std::pair<int64_t, const std::string*>> order;
+        order.reserve(_entries.size());
+        for( const auto& it : _entries ){
+            order.emplace_back(it.second.lastAccess, &it.first);
+        }
+        std::sort(order.begin(), order.end());
+        
+        // 最終アクセスの古いものから、容量内へ収まるまでインデックスから外す
+        for( const auto& it : order ){
+            if( _size <= _capacity ){
+                break;
+            }
+            auto entry = _entries.find(*it.second);
+            _size -= entry->second.size;
+            victims.emplace_back(entry->second.size, *it.second);
+            _entries.erase(entry);
+        }
+        _dirty = true;
+    }
+    for( const auto& it : victims ){
+        ::remove(makePath(it.second).c_str());
+        CCLOG("DiskCache evict [%s] %lld bytes", it.second.c_str(), static_cast<long long>(it.first));
+    }
+}
+
+NS_CC_EXT_END
@@ -0,0 +1,139 @@
+/****************************************************************************
+ Copyright (c) Yassy
+ https://github.com/yassy0413/cocos2dx-3.x-util
+ ****************************************************************************/
+#ifndef __CC_DISK_CACHE_H__
+#define __CC_DISK_CACHE_H__
+
+#include "cocos2d.h"
+#include "ExtensionMacros.h"
+#include <condition_variable>
+
+NS_CC_EXT_BEGIN
+
+/**
+ * 容量制限付きのディスクキャッシュ
+ *
+ * キー(URL)をハッシュ化したファイル名で、先頭2文字のディレクトリへ分散して保存する。
+ * キー、サイズ、最終アクセス時刻、付随する情報はインデックスファイルに記録され、起動時に読み込まれる。
+ * キャッシュの有無はメモリ上のインデックスで判定するので、ファイルシステムへの問い合わせは発生しない。
+ * 容量を超えた場合は、最終アクセスの古いものからバックグラウンドで削除される。
+  * インデックスはアプリがバックグラウンドへ移った時にも、バックグラウンドで保存される。
+ *
+ @code
+ auto cache = DiskCache::getInstance("LazySprite/");
+ cache->setCapacity(64 * 1024 * 1024);
+ const std::string path = cache->lookup(url);
+ @endcode
+ */
+class DiskCache
+{
+public:
+    CC_DISALLOW_COPY_AND_ASSIGN(DiskCache);
+    
+    /**
+     * cachePath (WritablePathからの相対パス) 毎の共有インスタンスを取得
+     * 各 cachePath で最初の呼び出しはGLスレッドから行うこと
+     */
+    static DiskCache* getInstance(const std::string& cachePath = "LazySprite/");
+    
+    /** Relase the all shared instances (GLスレッドから呼ぶこと。バックグラウンドの処理が終わるまで待つ) **/
+    static void destroyInstance();
+    
+    /**
+     * 容量の上限 (bytes) を設定。超過していれば削除を開始する
+     */
+    void setCapacity(int64_t bytes);
+    int64_t getCapacity() const;
+    
+    /**
+     * 現在の使用量 (bytes) を取得
+     */
+    int64_t getSize() const;
+    
+    /**
+     * キャッシュ済みであれば保存先のパスを返し、最終アクセス時刻を更新する
+     * @return 未キャッシュであれば空文字列
+     */
+    std::string lookup(const std::string& key);
+    
+    /**
+     * キャッシュ済みかどうか (最終アクセス時刻は更新しない)
+     */
+    bool exists(const std::string& key) const;
+    
+    /**
+     * keyの保存先パスを取得 (キャッシュの有無に関わらない)
+     */
+    std::string makePath(const std::string& key) const;
+    
+    /**
+     * データを書き込んでインデックスへ登録する
+     * 呼び出したスレッドで書き込むので、ワーカースレッドからの呼び出しを推奨
+     * @param metadata データに付随する情報 (改行を含まない文字列)
+     */
+    bool write(const std::string& key, const void* data, size_t size, const std::string& metadata = "");
+    
+    /**
+     * キャッシュに付随する情報を取得
+     * @return 未キャッシュであれば空文字列
+     */
+    std::string getMetadata(const std::string& key) const;
+    
+    /**
+     * キャッシュに付随する情報を更新する (未キャッシュであれば何もしない)
+     */
+    void setMetadata(const std::string& key, const std::string& metadata);
+    
+    /**
+     * キャッシュを削除
+     */
+    void remove(const std::string& key);
+    
+    /**
+     * 全てのキャッシュを削除
+     */
+    void clear();
+    
+    /**
+     * インデックスをバックグラウンドで保存する
+     */
+    void flush();
+
+private:
+    struct Entry {
+        int64_t size;
+        int64_t lastAccess;
+        std::string metadata;
+    };
+    
+    DiskCache(const std::string& rootDir);
+    ~DiskCache();
+    
+    std::string makeRelativePath(const std::string& key) const;
+    void loadIndex();
+    void saveIndex();
+    void requestTrim();
+    void trim();
+    void removeLegacyFiles();
+    /// TASK_IO で実行する。破棄する時は全ての実行を待つ
+    void enqueueTask(const std::function<void()>& task);
+    
+    const std::string _rootDir;
+    const std::string _indexPath;
+    std::unordered_map<std::string, Entry> _entries;
+    int64_t _size;
+    int64_t _capacity;
+    mutable std::mutex _mutex;
+    std::mutex _indexMutex;
+    bool _dirty;
+    std::atomic<bool> _trimming;
+    int32_t _numPendingTasks;
+    std::mutex _taskMutex;
+    std::condition_variable _taskCondition;
+    EventListenerCustom* _backgroundListener;
+};
+
+NS_CC_EXT_END
+
+#endif
@@ -0,0 +1,333 @@
+/****************************************************************************
+ Copyright (c) Yassy
+ https://github.com/yassy0413/cocos2dx-3.x-util
+ ****************************************************************************/
+#include "CCDynamicAtlas.h"
+#include <limits>
+
+NS_CC_EXT_BEGIN
+
+namespace {
+    /// 隣接する画像が滲まないように空ける隙間 (pixels)
+    const int32_t PADDING = 2;
+}
+
+static DynamicAtlas *s_pDynamicAtlas = nullptr; // pointer to singleton
+
+DynamicAtlas* DynamicAtlas::getInstance(){
+    if (s_pDynamicAtlas == nullptr) {
+        s_pDynamicAtlas = new (std::nothrow) DynamicAtlas();
+    }
+    return s_pDynamicAtlas;
+}
+
+void DynamicAtlas::destroyInstance(){
+    CC_SAFE_DELETE(s_pDynamicAtlas);
+}
+
+DynamicAtlas::DynamicAtlas()
+: _pageSize(1024)
+, _maxPages(4)
+, _maxImageSize(128)
+{}
+
+DynamicAtlas::~DynamicAtlas(){
+    for( auto& page : _pages ){
+        page.texture->release();
+        CC_SAFE_RELEASE(page.image);
+    }
+}
+
+bool DynamicAtlas::isEligible(int32_t width, int32_t height) const {
+    return width > 0 && height > 0 && width <= _maxImageSize && height <= _maxImageSize
+        && width + PADDING <= _pageSize && height + PADDING <= _pageSize;
+}
+
+bool DynamicAtlas::acquire(const std::string& key, Texture2D*& outTexture, Rect& outRect){
+    auto it = _locations.find(key);
+    if( it == _locations.end() ){
+        return false;
+    }
+    Location& location = it->second;
+    if( location.slot->refCount++ == 0 ){
+        _unused.erase(location.lru);
+    }
+    const float scale = CC_CONTENT_SCALE_FACTOR();
+    outTexture = location.page->texture;
+    outRect = Rect(location.slot->x / scale, location.shelf->y / scale,
+                   location.slot->usedWidth / scale, location.slot->usedHeight / scale);
+    return true;
+}
+
+void DynamicAtlas::release(const std::string& key){
+    auto it = _locations.find(key);
+    if( it == _locations.end() ){
+        return;
+    }
+    Location& location = it->second;
+    CC_ASSERT(location.slot->refCount > 0);
+    if( --location.slot->refCount == 0 ){
+        location.lru = _unused.insert(_unused.begin(), key);
+    }
+}
+
+bool DynamicAtlas::add(const std::string& key, Image* image){
+    if( image->isCompressed() ){
+        return false;
+    }
+    return add(key, image->getData(), image->getRenderFormat(), image->getWidth(), image->getHeight(), image->hasPremultipliedAlpha());
+}
+
+bool DynamicAtlas::add(const std::string& key, const unsigned char* pixels, Texture2D::PixelFormat format, int32_t width, int32_t height, bool premultipliedAlpha){
+    if( _locations.find(key) != _locations.end() ){
+        return true;
+    }
+    if( !isEligible(width, height) ){
+        return false;
+    }
+    if( format != Texture2D::PixelFormat::RGBA8888 && format != Texture2D::PixelFormat::RGB888 && format != Texture2D::PixelFormat::RGB565 ){
+        return false;
+    }
+    
+    Page* page = nullptr;
+    Shelf* shelf = nullptr;
+    Slot* slot = allocate(width + PADDING, height + PADDING, page, shelf);
+    if( !slot ){
+        return false;
+    }
+    slot->key = key;
+    slot->usedWidth = width;
+    slot->usedHeight = height;
+    slot->refCount = 0;
+    
+    // 乗算済みアルファのRGBA8888へ変換し、隙間を透明にして転送する
+    const int32_t uploadWidth = std::min(slot->width, width + PADDING);
+    const int32_t uploadHeight = std::min(shelf->height, height + PADDING);
+    std::vector<unsigned char> rgba(uploadWidth * uploadHeight * 4, 0);
+    for( int32_t y = 0; y < height; ++y ){
+        unsigned char* dst = &rgba[y * uploadWidth * 4];
+        for( int32_t x = 0; x < width; ++x, dst += 4 ){
+            const int32_t index = y * width + x;
+            if( format == Texture2D::PixelFormat::RGBA8888 ){
+                const unsigned char* p = pixels + index * 4;
+                if( premultipliedAlpha ){
+                    memcpy(dst, p, 4);
+                }else{
+                    dst[0] = static_cast<unsigned char>((p[0] * p[3] + 127) / 255);
+                    dst[1] = static_cast<unsigned char>((p[1] * p[3] + 127) / 255);
+                    dst[2] = static_cast<unsigned char>((p[2] * p[3] + 127) / 255);
+                    dst[3] = p[3];
+                }
+            }else if( format == Texture2D::PixelFormat::RGB888 ){
+                memcpy(dst, pixels + index * 3, 3);
+                dst[3] = 0xff;
+            }else{
+                const uint16_t p = reinterpret_cast<const uint16_t*>(pixels)[index];
+                dst[0] = static_cast<unsigned char>(((p >> 11) & 0x1f) * 255 / 31);
+                dst[1] = static_cast<unsigned char>(((p >> 5) & 0x3f) * 255 / 63);
+                dst[2] = static_cast<unsigned char>((p & 0x1f) * 255 / 31);
+                dst[3] = 0xff;
+            }
+        }
+    }
+    page->texture->updateWithData(rgba.data(), slot->x, shelf->y, uploadWidth, uploadHeight);
+    if( page->image ){
+        // コンテキストを失った時に復元するイメージへも書き込んでおく
+        unsigned char* dst = page->image->getData();
+        for( int32_t y = 0; y < uploadHeight; ++y ){
+            memcpy(dst + ((shelf->y + y) * page->size + slot->x) * 4, &rgba[y * uploadWidth * 4], uploadWidth * 4);
+        }
+    }
+    
+    Location& location = _locations[key];
+    location.page = page;
+    location.shelf = shelf;
+    for( auto it = shelf->slots.begin(); it != shelf->slots.end(); ++it ){
+        if( &*it == slot ){
+            location.slot = it;
+            break;
+        }
+    }
+    location.lru = _unused.insert(_unused.begin(), key);
+    return true;
+}
+
+bool DynamicAtlas::purge(){
+    for( const auto& it : _locations ){
+        if( it.second.slot->refCount > 0 ){
+            return false;
+        }
+    }
+    for( auto& page : _pages ){
+        page.texture->release();
+        CC_SAFE_RELEASE(page.image);
+    }
+    _pages.clear();
+    _locations.clear();
+    _unused.clear();
+    return true;
+}
+
+DynamicAtlas::Slot* DynamicAtlas::allocate(int32_t width, int32_t height, Page*& outPage, Shelf*& outShelf){
+    for( ;; ){
+        for( auto& page : _pages ){
+            if( Slot* slot = allocateInPage(page, width, height, outShelf) ){
+                outPage = &page;
+                return slot;
+            }
+        }
+        if( static_cast<int32_t>(_pages.size()) < _maxPages ){
+            if( Page* page = addPage() ){
+                if( Slot* slot = allocateInPage(*page, width, height, outShelf) ){
+                    outPage = page;
+                    return slot;
+                }
+            }
+        }
+        // 参照の無い領域を空けてから、もう一度探す
+        if( !evictOne() ){
+            return nullptr;
+        }
+    }
+}
+
+DynamicAtlas::Slot* DynamicAtlas::findInShelves(Page& page, int32_t width, int32_t height, int32_t maxHeight, Shelf*& outShelf){
+    // 高さの合うシェルフの空き領域から、無駄の少ないものを選ぶ
+    Shelf* bestShelf = nullptr;
+    std::list<Slot>::iterator bestSlot;
+    int32_t bestWaste = std::numeric_limits<int32_t>::max();
+    for( auto& shelf : page.shelves ){
+        if( shelf.slots.empty() || shelf.height < height || shelf.height > maxHeight ){
+            continue;
+        }
+        for( auto it = shelf.slots.begin(); it != shelf.slots.end(); ++it ){
+            if( it->key.empty() && it->width >= width ){
+                const int32_t waste = (it->width - width) * shelf.height + (shelf.height - height) * width;
+                if( waste < bestWaste ){
+                    bestWaste = waste;
+                    bestShelf = &shelf;
+                    bestSlot = it;
+                }
+            }
+        }
+        if( shelf.usedWidth + width <= page.size ){
+            const int32_t waste = (shelf.height - height) * width;
+            if( waste < bestWaste ){
+                bestWaste = waste;
+                bestShelf = &shelf;
+                bestSlot = shelf.slots.end();
+            }
+        }
+    }
+    if( !bestShelf ){
+        return nullptr;
+    }
+    outShelf = bestShelf;
+    if( bestSlot != bestShelf->slots.end() ){
+        return &*bestSlot;
+    }
+    Slot slot;
+    slot.x = bestShelf->usedWidth;
+    slot.width = width;
+    slot.usedWidth = 0;
+    slot.usedHeight = 0;
+    slot.refCount = 0;
+    bestShelf->usedWidth += width;
+    bestShelf->slots.push_back(slot);
+    return &bestShelf->slots.back();
+}
+
+DynamicAtlas::Slot* DynamicAtlas::allocateInPage(Page& page, int32_t width, int32_t height, Shelf*& outShelf){
+    // 高さの近いシェルフ
+    if( Slot* slot = findInShelves(page, width, height, height + height / 2, outShelf) ){
+        return slot;
+    }
+    
+    // 空になったシェルフを、この高さで使い直す
+    Shelf* emptyShelf = nullptr;
+    for( auto& shelf : page.shelves ){
+        if( shelf.slots.empty() && shelf.capacity >= height && (!emptyShelf || shelf.capacity < emptyShelf->capacity) ){
+            emptyShelf = &shelf;
+        }
+    }
+    // 空きが無ければ、新しいシェルフを追加する
+    if( !emptyShelf && page.usedHeight + height <= page.size ){
+        Shelf shelf;
+        shelf.y = page.usedHeight;
+        shelf.capacity = height;
+        shelf.usedWidth = 0;
+        page.usedHeight += height;
+        page.shelves.push_back(shelf);
+        emptyShelf = &page.shelves.back();
+    }
+    if( emptyShelf ){
+        emptyShelf->height = height;
+        emptyShelf->usedWidth = 0;
+        Slot slot;
+        slot.x = 0;
+        slot.width = width;
+        slot.usedWidth = 0;
+        slot.usedHeight = 0;
+        slot.refCount = 0;
+        emptyShelf->usedWidth = width;
+        emptyShelf->slots.push_back(slot);
+        outShelf = emptyShelf;
+        return &emptyShelf->slots.back();
+    }
+    
+    // 無駄は多いが、高さの収まるシェルフ
+    return findInShelves(page, width, height, page.size, outShelf);
+}
+
+bool DynamicAtlas::evictOne(){
+    if( _unused.empty() ){
+        return false;
+    }
+    const std::string key = _unused.back();
+    _unused.pop_back();
+    
+    auto it = _locations.find(key);
+    Shelf* shelf = it->second.shelf;
+    it->second.slot->key.clear();
+    _locations.erase(it);
+    
+    // シェルフ末尾の空き領域は、別の幅でも使えるように戻しておく
+    while( !shelf->slots.empty() && shelf->slots.back().key.empty() ){
+        shelf->usedWidth -= shelf->slots.back().width;
+        shelf->slots.pop_back();
+    }
+    CCLOG("DynamicAtlas evict [%s]", key.c_str());
+    return true;
+}
+
+DynamicAtlas::Page* DynamicAtlas::addPage(){
+    // 乗算済みアルファのテクスチャとして作成する
+    std::vector<unsigned char> pixels(_pageSize * _pageSize * 4, 0);
+    Image* image = new (std::nothrow) Image();
+    Texture2D* texture = new (std::nothrow) Texture2D();
+    const bool succeeded = image->initWithRawData(pixels.data(), pixels.size(), _pageSize, _pageSize, 8, true)
+                        && texture->initWithImage(image, Texture2D::PixelFormat::RGBA8888);
+    if( !succeeded ){
+        image->release();
+        texture->release();
+        return nullptr;
+    }
+    Page page;
+    page.texture = texture;
+#if CC_ENABLE_CACHE_TEXTURE_DATA
+    // TextureCache を通さないので、コンテキストを失った時に作り直せるように登録する (解除は Texture2D のデストラクタで行われる)
+    // 詰め込んだ画像もこのイメージへ書き込み、作り直した時に復元されるようにする
+    VolatileTextureMgr::addImage(texture, image);
+    page.image = image;
+#else
+    page.image = nullptr;
+    image->release();
+#endif
+    page.size = _pageSize;
+    page.usedHeight = 0;
+    _pages.push_back(page);
+    CCLOG("DynamicAtlas: add page %d", static_cast<int>(_pages.size()));
+    return &_pages.back();
+}
+
+NS_CC_EXT_END
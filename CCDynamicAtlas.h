@@ -0,0 +1,142 @@
+/****************************************************************************
+ Copyright (c) Yassy
+ https://github.com/yassy0413/cocos2dx-3.x-util
+ ****************************************************************************/
+#ifndef __CC_DYNAMIC_ATLAS_H__
+#define __CC_DYNAMIC_ATLAS_H__
+
+#include "cocos2d.h"
+#include "ExtensionMacros.h"
+
+NS_CC_EXT_BEGIN
+
+/**
+ * 小さな画像を共有テクスチャへ詰め込む動的アトラス
+ *
+ * 同じテクスチャを参照するスプライトはバッチ描画されるので、ドローコールを削減できる。
+ * 領域はシェルフ方式で割り当て、参照の無くなった領域は最後に使われた順が古いものから再利用される。
+ * GLスレッドからのみ利用すること。
+ */
+class DynamicAtlas
+{
+public:
+    CC_DISALLOW_COPY_AND_ASSIGN(DynamicAtlas);
+    
+    /** Return the shared instance **/
+    static DynamicAtlas *getInstance();
+    
+    /** Relase the shared instance **/
+    static void destroyInstance();
+    
+    /**
+     * アトラステクスチャ1枚のサイズ (pixels, default: 1024)
+     * 既にテクスチャが作成されている場合は、新しく作成されるものから適用される
+     */
+    void setPageSize(int32_t size){ _pageSize = size; }
+    inline int32_t getPageSize() const { return _pageSize; }
+    
+    /**
+     * アトラステクスチャの最大枚数 (default: 4)
+     */
+    void setMaxPages(int32_t count){ _maxPages = count; }
+    inline int32_t getMaxPages() const { return _maxPages; }
+    
+    /**
+     * 詰め込み対象とする画像の最大サイズ (pixels, default: 128)
+     */
+    void setMaxImageSize(int32_t size){ _maxImageSize = size; }
+    inline int32_t getMaxImageSize() const { return _maxImageSize; }
+    
+    /**
+     * 詰め込み対象となるサイズかどうか
+     */
+    bool isEligible(int32_t width, int32_t height) const;
+    
+    /**
+     * 登録済みかどうか (参照は増やさない)
+     */
+    bool contains(const std::string& key) const { return _locations.count(key) != 0; }
+    
+    /**
+     * 登録済みの領域の参照を増やして取得する
+     * @param outRect テクスチャ上の領域 (points)
+     * @return 未登録であれば false
+     */
+    bool acquire(const std::string& key, Texture2D*& outTexture, Rect& outRect);
+    
+    /**
+     * 領域の参照を減らす。参照が無くなった領域は再利用の対象となる
+     */
+    void release(const std::string& key);
+    
+    /**
+     * 画像を詰め込んで登録する (参照は増やさない)
+     * @param pixels RGBA8888, RGB888, RGB565 のいずれか
+     * @return 領域を確保できなければ false
+     */
+    bool add(const std::string& key, const unsigned char* pixels, Texture2D::PixelFormat format, int32_t width, int32_t height, bool premultipliedAlpha);
+    bool add(const std::string& key, Image* image);
+    
+    /**
+     * アトラステクスチャの枚数
+     */
+    int32_t getNumPages() const { return static_cast<int32_t>(_pages.size()); }
+    
+    /**
+     * 全ての領域を破棄する (参照中のものがあれば失敗する)
+     */
+    bool purge();
+
+private:
+    struct Slot {
+        std::string key;
+        int32_t x;
+        int32_t width;
+        int32_t usedWidth;
+        int32_t usedHeight;
+        int32_t refCount;
+    };
+    struct Shelf {
+        int32_t y;
+        /// 割り当てられている高さ (空になれば、これ以下の高さで使い直せる)
+        int32_t capacity;
+        int32_t height;
+        int32_t usedWidth;
+        std::list<Slot> slots;
+    };
+    struct Page {
+        Texture2D* texture;
+        /// CC_ENABLE_CACHE_TEXTURE_DATA であれば、テクスチャと同じ内容を保持する (それ以外は nullptr)
+        Image* image;
+        int32_t size;
+        int32_t usedHeight;
+        std::list<Shelf> shelves;
+    };
+    struct Location {
+        Page* page;
+        Shelf* shelf;
+        std::list<Slot>::iterator slot;
+        std::list<std::string>::iterator lru;
+    };
+    
+    DynamicAtlas();
+    ~DynamicAtlas();
+    
+    Slot* allocate(int32_t width, int32_t height, Page*& outPage, Shelf*& outShelf);
+    Slot* allocateInPage(Page& page, int32_t width, int32_t height, Shelf*& outShelf);
+    static Slot* findInShelves(Page& page, int32_t width, int32_t height, int32_t maxHeight, Shelf*& outShelf);
+    bool evictOne();
+    Page* addPage();
+    
+    std::list<Page> _pages;
+    std::unordered_map<std::string, Location> _locations;
+    /// 参照の無い領域 (先頭が最も新しい)
+    std::list<std::string> _unused;
+    int32_t _pageSize;
+    int32_t _maxPages;
+    int32_t _maxImageSize;
+};
+
+NS_CC_EXT_END
+
+#endif
@@ -0,0 +1,323 @@
+/****************************************************************************
+ Copyright (c) Yassy
+ https://github.com/yassy0413/cocos2dx-3.x-util
+ ****************************************************************************/
+#include "CCImageUtil.h"
+#include <csetjmp>
+#include <cmath>
+
+extern "C"
+{
+#if CC_USE_JPEG
+#include "jpeglib.h"
+#endif
+}
+
+NS_CC_EXT_BEGIN
+
+namespace imageutil {
+
+#if CC_USE_JPEG
+    namespace {
+        struct JpegErrorManager {
+            jpeg_error_mgr pub;
+            jmp_buf setjmpBuffer;
+        };
+        
+        void onJpegError(j_common_ptr cinfo){
+            JpegErrorManager* err = reinterpret_cast<JpegErrorManager*>(cinfo->err);
+            longjmp(err->setjmpBuffer, 1);
+        }
+        
+        void onJpegMessage(j_common_ptr cinfo){
+        }
+        
+        /// DCTスケーリングを使ってデコードし、RGBA8888のImageを作成する
+        Image* decodeJpeg(const unsigned char* data, ssize_t size, int maxWidth, int maxHeight){
+            jpeg_decompress_struct cinfo;
+            JpegErrorManager jerr;
+            // longjmpで戻った後も参照するので volatile にする
+            unsigned char* volatile rgba = nullptr;
+            unsigned char* volatile row = nullptr;
+            Image* image = nullptr;
+            
+            cinfo.err = jpeg_std_error(&jerr.pub);
+            jerr.pub.error_exit = onJpegError;
+            jerr.pub.output_message = onJpegMessage;
+            if( setjmp(jerr.setjmpBuffer) ){
+                jpeg_destroy_decompress(&cinfo);
+                free(rgba);
+                free(row);
+                return nullptr;
+            }
+            
+            jpeg_create_decompress(&cinfo);
+            jpeg_mem_src(&cinfo, const_cast<unsigned char*>(data), static_cast<unsigned long>(size));
+            jpeg_read_header(&cinfo, TRUE);
+            
+            // CMYK等は通常のデコードに任せる
+            if( cinfo.jpeg_color_space != JCS_YCbCr && cinfo.jpeg_color_space != JCS_GRAYSCALE && cinfo.jpeg_color_space != JCS_RGB ){
+                jpeg_destroy_decompress(&cinfo);
+                return nullptr;
+            }
+            
+            // 目的のサイズを下回らない範囲で、最大の縮小率を選ぶ
+            int targetWidth, targetHeight;
+            fitSize(cinfo.image_width, cinfo.image_height, maxWidth, maxHeight, targetWidth, targetHeight);
+            unsigned int denom = 8;
+            while( denom > 1 && ((cinfo.image_width + denom - 1) / denom < static_cast<unsigned int>(targetWidth) ||
+                                 (cinfo.image_height + denom - 1) / denom < static_cast<unsigned int>(targetHeight)) ){
+                denom /= 2;
+            }
+            cinfo.scale_num = 1;
+            cinfo.scale_denom = denom;
+            cinfo.out_color_space = JCS_RGB;
+            cinfo.dct_method = JDCT_IFAST;
+            jpeg_start_decompress(&cinfo);
+            
+            const int width = cinfo.output_width;
+            const int height = cinfo.output_height;
+            rgba = static_cast<unsigned char*>(malloc(width * height * 4));
+            row = static_cast<unsigned char*>(malloc(width * 3));
+            while( cinfo.output_scanline < cinfo.output_height ){
+                unsigned char* dst = rgba + cinfo.output_scanline * width * 4;
+                unsigned char* src = row;
+                JSAMPROW rows[1] = { src };
+                jpeg_read_scanlines(&cinfo, rows, 1);
+                for( int x = 0; x < width; ++x ){
+                    dst[x*4+0] = src[x*3+0];
+                    dst[x*4+1] = src[x*3+1];
+                    dst[x*4+2] = src[x*3+2];
+                    dst[x*4+3] = 0xff;
+                }
+            }
+            jpeg_finish_decompress(&cinfo);
+            jpeg_destroy_decompress(&cinfo);
+            free(row);
+            
+            image = new (std::nothrow) Image();
+            image->initWithRawData(rgba, width * height * 4, width, height, 8, false);
+            free(rgba);
+            
+            // DCTスケーリングで届かなかった分を縮小する
+            Image* result = shrink(image, targetWidth, targetHeight);
+            image->release();
+            return result;
+        }
+    }
+#endif
+    
+    void fitSize(int width, int height, int maxPixelSize, int& outWidth, int& outHeight){
+        fitSize(width, height, maxPixelSize, maxPixelSize, outWidth, outHeight);
+    }
+    
+    void fitSize(int width, int height, int maxWidth, int maxHeight, int& outWidth, int& outHeight){
+        outWidth = width;
+        outHeight = height;
+        float scale = 1.0f;
+        if( maxWidth > 0 && width > maxWidth ){
+            scale = static_cast<float>(maxWidth) / width;
+        }
+        if( maxHeight > 0 && height > maxHeight ){
+            scale = std::min(scale, static_cast<float>(maxHeight) / height);
+        }
+        if( scale < 1.0f ){
+            outWidth = std::max(1, static_cast<int>(width * scale + 0.5f));
+            outHeight = std::max(1, static_cast<int>(height * scale + 0.5f));
+        }
+    }
+    
+    Image* decode(const unsigned char* data, ssize_t size, int maxPixelSize){
+        return decode(data, size, maxPixelSize, maxPixelSize);
+    }
+    
+    Image* decode(const unsigned char* data, ssize_t size, int maxWidth, int maxHeight){
+        const bool limited = (maxWidth > 0 || maxHeight > 0);
+#if CC_USE_JPEG
+        if( limited && size > 2 && data[0] == 0xff && data[1] == 0xd8 ){
+            if( Image* image = decodeJpeg(data, size, maxWidth, maxHeight) ){
+                return image;
+            }
+        }
+#endif
+        Image* image = new (std::nothrow) Image();
+        if( !image->initWithImageData(data, size) ){
+            image->release();
+            return nullptr;
+        }
+        if( !limited ){
+            return image;
+        }
+        int width, height;
+        fitSize(image->getWidth(), image->getHeight(), maxWidth, maxHeight, width, height);
+        Image* result = shrink(image, width, height);
+        image->release();
+        return result;
+    }
+    
+    Image* shrink(Image* image, int width, int height){
+        const int srcWidth = image->getWidth();
+        const int srcHeight = image->getHeight();
+        const auto format = image->getRenderFormat();
+        const bool rgba = (format == Texture2D::PixelFormat::RGBA8888);
+        if( (!rgba && format != Texture2D::PixelFormat::RGB888) || image->isCompressed() ||
+            width <= 0 || height <= 0 || (width >= srcWidth && height >= srcHeight) ){
+            image->retain();
+            return image;
+        }
+        width = std::min(width, srcWidth);
+        height = std::min(height, srcHeight);
+        
+        const int bpp = rgba? 4 : 3;
+        const unsigned char* src = image->getData();
+        std::vector<unsigned char> dst(width * height * 4);
+        std::vector<uint32_t> sum(width * 4);
+        std::vector<int> xBegin(width + 1);
+        for( int x = 0; x <= width; ++x ){
+            xBegin[x] = static_cast<int>(static_cast<int64_t>(x) * srcWidth / width);
+        }
+        
+        for( int y = 0; y < height; ++y ){
+            const int y0 = static_cast<int>(static_cast<int64_t>(y) * srcHeight / height);
+            const int y1 = std::max(y0 + 1, static_cast<int>(static_cast<int64_t>(y + 1) * srcHeight / height));
+            std::fill(sum.begin(), sum.end(), 0);
+            
+            // 縦方向に加算しながら、横方向の範囲毎に集計する
+            for( int sy = y0; sy < y1; ++sy ){
+                const unsigned char* line = src + static_cast<size_t>(sy) * srcWidth * bpp;
+                for( int x = 0; x < width; ++x ){
+                    const int x1 = std::max(xBegin[x] + 1, xBegin[x+1]);
+                    uint32_t* s = &sum[x * 4];
+                    for( int sx = xBegin[x]; sx < x1; ++sx ){
+                        const unsigned char* p = line + sx * bpp;
+                        s[0] += p[0];
+                        s[1] += p[1];
+                        s[2] += p[2];
+                        s[3] += rgba? p[3] : 0xff;
+                    }
+                }
+            }
+            
+            unsigned char* out = &dst[static_cast<size_t>(y) * width * 4];
+            for( int x = 0; x < width; ++x ){
+                const uint32_t area = (y1 - y0) * std::max(1, xBegin[x+1] - xBegin[x]);
+                for( int c = 0; c < 4; ++c ){
+                    out[x * 4 + c] = static_cast<unsigned char>((sum[x * 4 + c] + area / 2) / area);
+                }
+            }
+        }
+        
+        Image* result = new (std::nothrow) Image();
+        result->initWithRawData(dst.data(), dst.size(), width, height, 8, image->hasPremultipliedAlpha());
+        return result;
+    }
+    
+    namespace {
+        const char BASE83_CHARS[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz#$%*+,-.:;=?@[]^_{|}~";
+        
+        /// @return 不正な文字が含まれていれば -1
+        int decodeBase83(const std::string& str, size_t begin, size_t end){
+            int value = 0;
+            for( size_t lp = begin; lp < end; ++lp ){
+                const char* p = strchr(BASE83_CHARS, str[lp]);
+                if( !p || str[lp] == '\0' ){
+                    return -1;
+                }
+                value = value * 83 + static_cast<int>(p - BASE83_CHARS);
+            }
+            return value;
+        }
+        
+        float sRGBToLinear(int value){
+            const float v = value / 255.0f;
+            return (v <= 0.04045f)? (v / 12.92f) : std::pow((v + 0.055f) / 1.055f, 2.4f);
+        }
+        
+        unsigned char linearTosRGB(float value){
+            const float v = std::max(0.0f, std::min(1.0f, value));
+            const float s = (v <= 0.0031308f)? (v * 12.92f) : (1.055f * std::pow(v, 1.0f / 2.4f) - 0.055f);
+            return static_cast<unsigned char>(s * 255.0f + 0.5f);
+        }
+        
+        float signPow(float value, float exp){
+            return std::copysign(std::pow(std::abs(value), exp), value);
+        }
+    }
+    
+    Image* decodeBlurHash(const std::string& hash, int width, int height, float punch){
+        if( hash.size() < 6 || width <= 0 || height <= 0 ){
+            return nullptr;
+        }
+        // 先頭の1文字が成分の数、次の1文字がAC成分の最大値を表す
+        const int sizeFlag = decodeBase83(hash, 0, 1);
+        const int quantisedMaximum = decodeBase83(hash, 1, 2);
+        if( sizeFlag < 0 || quantisedMaximum < 0 ){
+            return nullptr;
+        }
+        const int numX = sizeFlag % 9 + 1;
+        const int numY = sizeFlag / 9 + 1;
+        if( hash.size() != static_cast<size_t>(4 + 2 * numX * numY) ){
+            return nullptr;
+        }
+        const float maximum = (quantisedMaximum + 1) / 166.0f * punch;
+        
+        std::vector<float> colors(numX * numY * 3);
+        const int dc = decodeBase83(hash, 2, 6);
+        if( dc < 0 ){
+            return nullptr;
+        }
+        colors[0] = sRGBToLinear(dc >> 16);
+        colors[1] = sRGBToLinear((dc >> 8) & 0xff);
+        colors[2] = sRGBToLinear(dc & 0xff);
+        for( int lp = 1; lp < numX * numY; ++lp ){
+            const int ac = decodeBase83(hash, 4 + lp * 2, 6 + lp * 2);
+            if( ac < 0 ){
+                return nullptr;
+            }
+            colors[lp * 3 + 0] = signPow((ac / (19 * 19) - 9) / 9.0f, 2.0f) * maximum;
+            colors[lp * 3 + 1] = signPow((ac / 19 % 19 - 9) / 9.0f, 2.0f) * maximum;
+            colors[lp * 3 + 2] = signPow((ac % 19 - 9) / 9.0f, 2.0f) * maximum;
+        }
+        
+        // 余弦の値は行と列で共通なので、先に求めておく
+        std::vector<float> cosX(width * numX);
+        std::vector<float> cosY(height * numY);
+        for( int x = 0; x < width; ++x ){
+            for( int i = 0; i < numX; ++i ){
+                cosX[x * numX + i] = std::cos(static_cast<float>(M_PI) * x * i / width);
+            }
+        }
+        for( int y = 0; y < height; ++y ){
+            for( int j = 0; j < numY; ++j ){
+                cosY[y * numY + j] = std::cos(static_cast<float>(M_PI) * y * j / height);
+            }
+        }
+        
+        std::vector<unsigned char> dst(static_cast<size_t>(width) * height * 4);
+        for( int y = 0; y < height; ++y ){
+            for( int x = 0; x < width; ++x ){
+                float r = 0, g = 0, b = 0;
+                for( int j = 0; j < numY; ++j ){
+                    for( int i = 0; i < numX; ++i ){
+                        const float basis = cosX[x * numX + i] * cosY[y * numY + j];
+                        const float* color = &colors[(j * numX + i) * 3];
+                        r += color[0] * basis;
+                        g += color[1] * basis;
+                        b += color[2] * basis;
+                    }
+                }
+                unsigned char* out = &dst[(static_cast<size_t>(y) * width + x) * 4];
+                out[0] = linearTosRGB(r);
+                out[1] = linearTosRGB(g);
+                out[2] = linearTosRGB(b);
+                out[3] = 0xff;
+            }
+        }
+        
+        Image* image = new (std::nothrow) Image();
+        image->initWithRawData(dst.data(), dst.size(), width, height, 8, false);
+        return image;
+    }
+}
+
+NS_CC_EXT_END
@@ -0,0 +1,59 @@
+/****************************************************************************
+ Copyright (c) Yassy
+ https://github.com/yassy0413/cocos2dx-3.x-util
+ ****************************************************************************/
+#ifndef __CC_IMAGE_UTIL_H__
+#define __CC_IMAGE_UTIL_H__
+
+#include "cocos2d.h"
+#include "ExtensionMacros.h"
+
+NS_CC_EXT_BEGIN
+
+/**
+ * 画像の縮小と、プレビューのデコード処理
+ * ワーカースレッドから呼び出せる。戻り値のImageは呼び出し側でreleaseすること
+ */
+namespace imageutil {
+    
+    /**
+     * 長辺がmaxPixelSize以下になる縮小サイズを算出
+     */
+    void fitSize(int width, int height, int maxPixelSize, int& outWidth, int& outHeight);
+    
+    /**
+     * maxWidth x maxHeight に収まる縮小サイズを算出 (0 の辺は制限しない)
+     */
+    void fitSize(int width, int height, int maxWidth, int maxHeight, int& outWidth, int& outHeight);
+    
+    /**
+     * 長辺がmaxPixelSize以下になるように縮小しながらデコードする
+     * JPEGはデコード時に1/2,1/4,1/8の縮小を行い、残りをボックスフィルタで縮小する
+     * @param maxPixelSize 0であれば縮小しない
+     * @return 失敗時は nullptr
+     */
+    Image* decode(const unsigned char* data, ssize_t size, int maxPixelSize);
+    
+    /**
+     * maxWidth x maxHeight に収まるように縮小しながらデコードする (0 の辺は制限しない)
+     */
+    Image* decode(const unsigned char* data, ssize_t size, int maxWidth, int maxHeight);
+    
+    /**
+     * ボックスフィルタ (面積平均) でwidth x heightへ縮小したRGBA8888のImageを作成する
+     * RGBA8888, RGB888以外の形式や、縮小にならない場合は imageをretainして返す
+     */
+    Image* shrink(Image* image, int width, int height);
+    
+    /**
+     * BlurHash の文字列から、width x height のRGBA8888のImageを作成する
+     * 数十ピクセル程度であれば、GLスレッドで呼び出しても問題ない速さで終わる
+     * @param punch 色の強さ
+     * @return 不正な文字列であれば nullptr
+     */
+    Image* decodeBlurHash(const std::string& hash, int width, int height, float punch = 1.0f);
+}
+
+NS_CC_EXT_END
+
+#endif
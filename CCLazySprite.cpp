@@ -3,90 +3,1094 @@
  https://github.com/yassy0413/cocos2dx-3.x-util
  ****************************************************************************/
 #include "CCLazySprite.h"
-#include "network/HttpClient.h"
+#include "CCDiskCache.h"
+#include "CCURLTextureCache.h"
+#include "CCImageUtil.h"
+#include "CCDynamicAtlas.h"
+#include "CCZipUtil.h"
+#include <deque>
+#include <ctime>
 
 NS_CC_EXT_BEGIN
 
-typedef std::unordered_map<std::string, std::list<LazySprite*>> DownloadingTaskList;
-static DownloadingTaskList* _downloadingTasks = nullptr;
+/// 読み込み中のキー毎に、結果を待っているスプライトを管理する (スプライトはretainしない)
+struct LoadingTask {
+    /// ダウンロードを待っていれば DownloadTask のキー
+    std::string downloadKey;
+    std::list<LazySprite*> targets;
+    /// 先読みの完了を待っているコールバック
+    std::vector<std::function<void(bool succeeded)>> prefetchers;
+    /// 必要な段階 (スプライトが待っていれば Texture)
+    LazySprite::PrefetchLevel level;
+    /// ダウンロードを終えて、ファイルの読み込みやデコードを行っている
+    bool decoding;
+};
+typedef std::unordered_map<std::string, LoadingTask> LoadingTaskList;
+static LoadingTaskList* _loadingTasks = nullptr;
 
-void LazySprite::requestDownload(const std::string& url, const std::string& cacheFilePath, const std::string& cacheFileDir, LazySprite* target){
+/// ダウンロード中のURL毎に、結果を待っている読み込みタスクを管理する
+/// 縮小するサイズが異なっても、ダウンロードとディスクキャッシュへの保存は1度で済ませ、デコードだけをサイズ毎に行う
+struct DownloadTask {
+    URLDownloader::RequestId requestId;
+    std::string url;
+    std::string cachePath;
+    /// 待っている読み込みタスクの縮小サイズ (キーは makeTextureKey で求める)
+    std::vector<int32_t> maxPixelSizes;
+};
+typedef std::unordered_map<std::string, DownloadTask> DownloadTaskList;
+static DownloadTaskList* _downloadTasks = nullptr;
+
+/// 先読みの要求毎の進捗
+struct PrefetchBatch {
+    int32_t total;
+    int32_t completed;
+    int32_t succeeded;
+    ccLazySpritePrefetchCallback callback;
+    ccLazySpritePrefetchProgress progress;
+};
+
+/// 先読みを待っているURL
+struct PrefetchItem {
+    std::string url;
+    std::string cachePath;
+    int32_t maxPixelSize;
+    LazySprite::PrefetchLevel level;
+    std::shared_ptr<PrefetchBatch> batch;
+};
+static std::deque<PrefetchItem> _prefetchQueue;
+static int32_t _numRunningPrefetches = 0;
+static int32_t _maxConcurrentPrefetches = 2;
+/// 先読みしたテクスチャを、使われなくても解放しない時間 (秒)
+static const float PREFETCH_PIN_SECONDS = 60.0f;
+
+static void reportPrefetch(const std::shared_ptr<PrefetchBatch>& batch, bool succeeded){
+    ++batch->completed;
+    if( succeeded ){
+        ++batch->succeeded;
+    }
+    if( batch->progress != nullptr ){
+        batch->progress(batch->completed, batch->total);
+    }
+    if( batch->completed == batch->total && batch->callback != nullptr ){
+        batch->callback(batch->succeeded, batch->total);
+    }
+}
+
+#pragma mark -- PreDecoded
+
+namespace {
+    /// GPUへそのまま転送できる形式のヘッダ
+    struct PreDecodedHeader {
+        char magic[4];
+        uint32_t version;
+        uint32_t width;
+        uint32_t height;
+        uint32_t pixelFormat;
+        uint32_t premultipliedAlpha;
+    };
+    const char PREDECODED_MAGIC[4] = {'L', 'S', 'T', 'X'};
+    const uint32_t PREDECODED_VERSION = 1;
+    /// BlurHash のプレビューをデコードする長辺のサイズ
+    const int PLACEHOLDER_BLURHASH_SIZE = 32;
     
-    bool needHttpRequest = true;
+    LazySprite::PreDecodedFormat s_preDecodedFormat = LazySprite::PreDecodedFormat::None;
+    bool s_atlasEnabled = false;
     
-    if( _downloadingTasks ){
-        auto it = _downloadingTasks->find(url);
-        if( it != _downloadingTasks->end() ){
-            it->second.push_back(target);
-            needHttpRequest = false;
+    std::string makePreDecodedKey(const std::string& key){
+        return key + "#tex";
+    }
+    
+    std::string makeDownloadKey(const std::string& url, const std::string& cachePath){
+        return cachePath + "\n" + url;
+    }
+    
+    /**
+     * デコード済みのImageを、GPUへそのまま転送できる形式へ変換する
+     * 不透明であれば RGB565 か RGB888、半透明があれば RGBA8888 で保存する
+     */
+    std::shared_ptr<std::vector<char>> encodePreDecoded(Image* image, LazySprite::PreDecodedFormat format){
+        auto buffer = std::make_shared<std::vector<char>>();
+        const auto renderFormat = image->getRenderFormat();
+        const bool rgba = (renderFormat == Texture2D::PixelFormat::RGBA8888);
+        if( (!rgba && renderFormat != Texture2D::PixelFormat::RGB888) || image->isCompressed() ){
+            return buffer;
         }
-    }else{
-        _downloadingTasks = new (std::nothrow) DownloadingTaskList();
+        const int width = image->getWidth();
+        const int height = image->getHeight();
+        const size_t pixels = static_cast<size_t>(width) * height;
+        const unsigned char* src = image->getData();
+        
+        bool opaque = true;
+        if( rgba ){
+            for( size_t lp = 0; lp < pixels && opaque; ++lp ){
+                opaque = (src[lp * 4 + 3] == 0xff);
+            }
+        }
+        
+        PreDecodedHeader header;
+        memcpy(header.magic, PREDECODED_MAGIC, sizeof(header.magic));
+        header.version = PREDECODED_VERSION;
+        header.width = width;
+        header.height = height;
+        header.premultipliedAlpha = image->hasPremultipliedAlpha()? 1 : 0;
+        
+        const int srcBpp = rgba? 4 : 3;
+        if( !opaque ){
+            header.pixelFormat = static_cast<uint32_t>(Texture2D::PixelFormat::RGBA8888);
+            buffer->resize(sizeof(header) + pixels * 4);
+            memcpy(buffer->data() + sizeof(header), src, pixels * 4);
+        }else if( format == LazySprite::PreDecodedFormat::RGB565 ){
+            header.pixelFormat = static_cast<uint32_t>(Texture2D::PixelFormat::RGB565);
+            buffer->resize(sizeof(header) + pixels * 2);
+            uint16_t* dst = reinterpret_cast<uint16_t*>(buffer->data() + sizeof(header));
+            for( size_t lp = 0; lp < pixels; ++lp ){
+                const unsigned char* p = src + lp * srcBpp;
+                dst[lp] = static_cast<uint16_t>(((p[0] >> 3) << 11) | ((p[1] >> 2) << 5) | (p[2] >> 3));
+            }
+        }else{
+            header.pixelFormat = static_cast<uint32_t>(Texture2D::PixelFormat::RGB888);
+            buffer->resize(sizeof(header) + pixels * 3);
+            char* dst = buffer->data() + sizeof(header);
+            for( size_t lp = 0; lp < pixels; ++lp ){
+                memcpy(dst + lp * 3, src + lp * srcBpp, 3);
+            }
+        }
+        memcpy(buffer->data(), &header, sizeof(header));
+        return buffer;
+    }
+    
+    /**
+     * GPUへそのまま転送できる形式のヘッダを検証し、ピクセルデータの位置を取得する
+     */
+    bool parsePreDecoded(const void* data, size_t size, PreDecodedHeader& header, const unsigned char*& outPixels, size_t& outDataLen){
+        if( !data || size < sizeof(PreDecodedHeader) ){
+            return false;
+        }
+        memcpy(&header, data, sizeof(header));
+        if( memcmp(header.magic, PREDECODED_MAGIC, sizeof(header.magic)) != 0 || header.version != PREDECODED_VERSION ){
+            return false;
+        }
+        size_t bpp;
+        switch( static_cast<Texture2D::PixelFormat>(header.pixelFormat) ){
+            case Texture2D::PixelFormat::RGBA8888: bpp = 4; break;
+            case Texture2D::PixelFormat::RGB888: bpp = 3; break;
+            case Texture2D::PixelFormat::RGB565: bpp = 2; break;
+            default: return false;
+        }
+        outDataLen = static_cast<size_t>(header.width) * header.height * bpp;
+        if( size < sizeof(header) + outDataLen ){
+            return false;
+        }
+        outPixels = static_cast<const unsigned char*>(data) + sizeof(header);
+        return true;
+    }
+    
+    /**
+     * メモリマップしたピクセルを直接転送したテクスチャ
+     * initWithData は乗算済みアルファの情報を持たないので、ヘッダの値を設定する
+     */
+    class PreDecodedTexture : public Texture2D {
+    public:
+        void setPremultipliedAlpha(bool premultipliedAlpha){ _hasPremultipliedAlpha = premultipliedAlpha; }
+    };
+    
+    /**
+     * GPUへそのまま転送できる形式からテクスチャを作成する
+     * @return 失敗時は nullptr
+     */
+    Texture2D* createTextureFromPreDecoded(const PreDecodedHeader& header, const unsigned char* pixels, size_t dataLen){
+        const auto pixelFormat = static_cast<Texture2D::PixelFormat>(header.pixelFormat);
+#if CC_ENABLE_CACHE_TEXTURE_DATA
+        // マップはテクスチャを作ったら解除するので、コンテキストを失った時に作り直せるように Image へコピーして VolatileTextureMgr へ登録する
+        std::vector<unsigned char> rgba;
+        if( pixelFormat != Texture2D::PixelFormat::RGBA8888 ){
+            const size_t numPixels = static_cast<size_t>(header.width) * header.height;
+            rgba.resize(numPixels * 4);
+            for( size_t lp = 0; lp < numPixels; ++lp ){
+                unsigned char* dst = &rgba[lp * 4];
+                if( pixelFormat == Texture2D::PixelFormat::RGB565 ){
+                    const uint16_t p = reinterpret_cast<const uint16_t*>(pixels)[lp];
+                    dst[0] = static_cast<unsigned char>(((p >> 11) & 0x1f) * 255 / 31);
+                    dst[1] = static_cast<unsigned char>(((p >> 5) & 0x3f) * 255 / 63);
+                    dst[2] = static_cast<unsigned char>((p & 0x1f) * 255 / 31);
+                }else{
+                    memcpy(dst, pixels + lp * 3, 3);
+                }
+                dst[3] = 0xff;
+            }
+            pixels = rgba.data();
+            dataLen = rgba.size();
+        }
+        Image* image = new (std::nothrow) Image();
+        Texture2D* texture = new (std::nothrow) Texture2D();
+        const bool succeeded = image->initWithRawData(pixels, dataLen, header.width, header.height, 8, header.premultipliedAlpha != 0)
+                            && texture->initWithImage(image, pixelFormat);
+        if( succeeded ){
+            VolatileTextureMgr::addImage(texture, image);
+        }
+        image->release();
+#else
+        PreDecodedTexture* texture = new (std::nothrow) PreDecodedTexture();
+        const bool succeeded = texture->initWithData(pixels, dataLen, pixelFormat, header.width, header.height, Size(header.width, header.height));
+        texture->setPremultipliedAlpha(header.premultipliedAlpha != 0);
+#endif
+        if( !succeeded ){
+            texture->release();
+            return nullptr;
+        }
+        return texture;
     }
+}
+
+#pragma mark -- Revalidation
+
+namespace {
+    LazySprite::RevalidationPolicy s_revalidationPolicy = LazySprite::RevalidationPolicy::Never;
+    const int64_t NEVER_EXPIRES = std::numeric_limits<int64_t>::max();
+    /// max-age が無い場合に、再検証せずに使う期間 (秒)
+    const int64_t DEFAULT_MAX_AGE = 24 * 60 * 60;
     
-    target->retain();
+    std::string trim(const std::string& str){
+        const auto begin = str.find_first_not_of(" \t\r");
+        if( begin == std::string::npos ){
+            return "";
+        }
+        return str.substr(begin, str.find_last_not_of(" \t\r") - begin + 1);
+    }
     
-    if( needHttpRequest ){
-        _downloadingTasks->emplace(url, std::list<LazySprite*>{target});
+    /**
+     * 再検証のための情報
+     * DiskCache へは [期限] [ETag] [Last-Modified] をタブ区切りで記録する
+     */
+    struct CacheValidator {
+        int64_t expires;
+        std::string etag;
+        std::string lastModified;
+        
+        CacheValidator()
+        : expires(NEVER_EXPIRES)
+        {}
         
-        network::HttpRequest* req = new network::HttpRequest();
-        req->setRequestType( network::HttpRequest::Type::GET );
-        req->setUrl( url.c_str() );
-        req->setResponseCallback([cacheFilePath, cacheFileDir](network::HttpClient* client, network::HttpResponse* response){
+        static CacheValidator parse(const std::string& metadata){
+            CacheValidator validator;
+            const auto sep1 = metadata.find('\t');
+            const auto sep2 = (sep1 == std::string::npos)? sep1 : metadata.find('\t', sep1+1);
+            if( sep2 != std::string::npos ){
+                validator.expires = strtoll(metadata.c_str(), nullptr, 10);
+                validator.etag = metadata.substr(sep1+1, sep2 - (sep1+1));
+                validator.lastModified = metadata.substr(sep2+1);
+            }
+            return validator;
+        }
+        
+        /**
+         * レスポンスヘッダから作成する。304 のように含まれていない項目は base を引き継ぐ
+         */
+        static CacheValidator fromResponse(network::HttpResponse* response, const CacheValidator& base){
+            CacheValidator validator = base;
+            int64_t maxAge = -1;
+            bool noCache = false;
             
-            std::list<LazySprite*> targets;
-            if( _downloadingTasks ){
-                auto it = _downloadingTasks->find( response->getHttpRequest()->getUrl() );
-                if( it != _downloadingTasks->end() ){
-                    targets = std::move(it->second);
+            const std::vector<char>* header = response->getResponseHeader();
+            std::string line;
+            for( size_t lp = 0, size = header? header->size() : 0; lp <= size; ++lp ){
+                if( lp < size && (*header)[lp] != '\n' ){
+                    line.push_back((*header)[lp]);
+                    continue;
+                }
+                // リダイレクトされた場合は、最後のレスポンスのヘッダだけを使う
+                if( line.compare(0, 5, "HTTP/") == 0 ){
+                    validator = base;
+                    maxAge = -1;
+                    noCache = false;
+                }
+                const auto colon = line.find(':');
+                if( colon != std::string::npos ){
+                    std::string name = trim(line.substr(0, colon));
+                    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+                    const std::string value = trim(line.substr(colon+1));
+                    if( name == "etag" ){
+                        validator.etag = value;
+                    }else if( name == "last-modified" ){
+                        validator.lastModified = value;
+                    }else if( name == "cache-control" ){
+                        std::string directives = value;
+                        std::transform(directives.begin(), directives.end(), directives.begin(), ::tolower);
+                        noCache = noCache || directives.find("no-cache") != std::string::npos || directives.find("no-store") != std::string::npos;
+                        const auto pos = directives.find("max-age=");
+                        if( pos != std::string::npos ){
+                            maxAge = strtoll(directives.c_str() + pos + 8, nullptr, 10);
+                        }
+                    }
+                }
+                line.clear();
+            }
+            
+            // 期限が無ければ、問い合わせられる場合に限って一定期間の後に再検証する
+            if( maxAge >= 0 && !noCache ){
+                validator.expires = static_cast<int64_t>(time(nullptr)) + maxAge;
+            }else if( noCache ){
+                validator.expires = 0;
+            }else if( validator.canRevalidate() ){
+                validator.expires = static_cast<int64_t>(time(nullptr)) + DEFAULT_MAX_AGE;
+            }else{
+                validator.expires = NEVER_EXPIRES;
+            }
+            return validator;
+        }
+        
+        std::string serialize() const {
+            // 改行やタブはインデックスを壊すので取り除く
+            auto sanitize = [](std::string str){
+                std::replace_if(str.begin(), str.end(), [](char c){ return c == '\t' || c == '\r' || c == '\n'; }, ' ');
+                return str;
+            };
+            return StringUtils::format("%lld\t", static_cast<long long>(expires)) + sanitize(etag) + "\t" + sanitize(lastModified);
+        }
+        
+        /// 内容が同じかどうかの比較に使う
+        std::string tag() const {
+            return etag.empty()? lastModified : etag;
+        }
+        
+        bool canRevalidate() const {
+            return !etag.empty() || !lastModified.empty();
+        }
+        
+        bool isStale() const {
+            switch( s_revalidationPolicy ){
+                case LazySprite::RevalidationPolicy::Never: return false;
+                case LazySprite::RevalidationPolicy::Expired: return expires <= static_cast<int64_t>(time(nullptr));
+                case LazySprite::RevalidationPolicy::Always: return true;
+            }
+            return false;
+        }
+        
+        std::vector<std::string> makeConditionalHeaders() const {
+            std::vector<std::string> headers;
+            if( !etag.empty() ){
+                headers.push_back("If-None-Match: " + etag);
+            }
+            if( !lastModified.empty() ){
+                headers.push_back("If-Modified-Since: " + lastModified);
+            }
+            return headers;
+        }
+    };
+    
+    /**
+     * 保存されている内容の再検証のための情報を取得する
+     * @return 元のファイルもデコード済みのデータも保存されていなければ false
+     */
+    bool findCacheValidator(DiskCache* cache, const std::string& url, const std::string& key, CacheValidator& outValidator){
+        if( cache->exists(url) ){
+            outValidator = CacheValidator::parse(cache->getMetadata(url));
+            return true;
+        }
+        const std::string preDecodedKey = makePreDecodedKey(key);
+        if( s_preDecodedFormat != LazySprite::PreDecodedFormat::None && cache->exists(preDecodedKey) ){
+            outValidator = CacheValidator::parse(cache->getMetadata(preDecodedKey));
+            return true;
+        }
+        return false;
+    }
+}
+
+#pragma mark -- LoadingTask
+
+bool LazySprite::joinLoadingTask(const std::string& key, LazySprite* target){
+    if( _loadingTasks ){
+        auto it = _loadingTasks->find(key);
+        if( it != _loadingTasks->end() ){
+            it->second.targets.push_back(target);
+            it->second.level = PrefetchLevel::Texture;
+            target->_loading = true;
+            updateDownloadPriority(key);
+            return true;
+        }
+    }else{
+        _loadingTasks = new (std::nothrow) LoadingTaskList();
+    }
+    
+    LoadingTask& task = (*_loadingTasks)[key];
+    task.targets.push_back(target);
+    task.level = PrefetchLevel::Texture;
+    task.decoding = false;
+    target->_loading = true;
+    return false;
+}
+
+void LazySprite::leaveLoadingTask(const std::string& key, LazySprite* target){
+    if( !_loadingTasks ){
+        return;
+    }
+    auto it = _loadingTasks->find(key);
+    if( it == _loadingTasks->end() ){
+        return;
+    }
+    it->second.targets.remove(target);
+    target->_loading = false;
+    
+    if( !it->second.targets.empty() || !it->second.prefetchers.empty() ){
+        updateDownloadPriority(key);
+    }else{
+        removeIdleLoadingTask(key);
+    }
+}
+
+void LazySprite::removeIdleLoadingTask(const std::string& key){
+    auto it = _loadingTasks->find(key);
+    if( it == _loadingTasks->end() || !it->second.targets.empty() || !it->second.prefetchers.empty() ){
+        return;
+    }
+    if( !it->second.decoding ){
+        // 誰も待っていないので、他のサイズが待っていなければダウンロードを取り消す
+        if( !it->second.downloadKey.empty() ){
+            auto download = _downloadTasks->find(it->second.downloadKey);
+            CC_ASSERT( download != _downloadTasks->end() );
+            auto& maxPixelSizes = download->second.maxPixelSizes;
+            const std::string& url = download->second.url;
+            maxPixelSizes.erase(std::remove_if(maxPixelSizes.begin(), maxPixelSizes.end(), [&url, &key](int32_t maxPixelSize){
+                return makeTextureKey(url, maxPixelSize) == key;
+            }), maxPixelSizes.end());
+            if( maxPixelSizes.empty() ){
+                URLDownloader::getInstance()->cancel(download->second.requestId);
+                _downloadTasks->erase(download);
+                if( _downloadTasks->empty() ){
+                    CC_SAFE_DELETE(_downloadTasks);
                 }
-                _downloadingTasks->erase(it);
-                
-                if( _downloadingTasks->empty() ){
-                    CC_SAFE_DELETE(_downloadingTasks);
+            }
+        }
+        _loadingTasks->erase(it);
+        if( _loadingTasks->empty() ){
+            CC_SAFE_DELETE(_loadingTasks);
+        }
+    }
+}
+
+void LazySprite::updateDownloadPriority(const std::string& key){
+    if( !_loadingTasks ){
+        return;
+    }
+    auto it = _loadingTasks->find(key);
+    if( it == _loadingTasks->end() || it->second.downloadKey.empty() ){
+        return;
+    }
+    // 同じダウンロードを待っている全てのスプライトの中で、最も高い優先度を適用する
+    const DownloadTask& download = _downloadTasks->at(it->second.downloadKey);
+    auto priority = URLDownloader::Priority::Prefetch;
+    for( int32_t maxPixelSize : download.maxPixelSizes ){
+        auto waiting = _loadingTasks->find(makeTextureKey(download.url, maxPixelSize));
+        if( waiting == _loadingTasks->end() ){
+            continue;
+        }
+        for( auto target : waiting->second.targets ){
+            priority = std::min(priority, target->getEffectiveDownloadPriority());
+        }
+    }
+    URLDownloader::getInstance()->setPriority(download.requestId, priority);
+}
+
+void LazySprite::startLoading(const Source& source){
+    // 再検証が必要であれば、条件付きでダウンロードする
+    CacheValidator validator;
+    if( findCacheValidator(DiskCache::getInstance(source.cachePath), source.url, source.key, validator) && validator.isStale() ){
+        startDownload(source);
+        return;
+    }
+    if( !startCacheLoad(source) ){
+        startDownload(source);
+    }
+}
+
+bool LazySprite::startCacheLoad(const Source& source){
+    auto cache = DiskCache::getInstance(source.cachePath);
+    Source cached = source;
+    cached.metadata = cache->getMetadata(source.url);
+    
+    // GPUへそのまま転送できる形式が保存されていれば、デコードを省略する
+    if( s_preDecodedFormat != PreDecodedFormat::None ){
+        const std::string preDecodedKey = makePreDecodedKey(source.key);
+        const std::string preDecodedPath = cache->lookup(preDecodedKey);
+        if( !preDecodedPath.empty() ){
+            // 元のファイルが更新されていれば使わない
+            if( !cache->exists(source.url) || CacheValidator::parse(cache->getMetadata(preDecodedKey)).tag() == CacheValidator::parse(cached.metadata).tag() ){
+                startPreDecodedLoad(cached, preDecodedPath);
+                return true;
+            }
+            cache->remove(preDecodedKey);
+        }
+    }
+    
+    // インデックスはメモリ上にあるので、ファイルシステムへの問い合わせは発生しない
+    const std::string cacheFilePath = cache->lookup(source.url);
+    if( !cacheFilePath.empty() ){
+        CCLOG("cache hit [%s]", source.url.c_str());
+        startFileLoad(cached, cacheFilePath);
+        return true;
+    }
+    return false;
+}
+
+void LazySprite::startDownload(const Source& source){
+    const std::string downloadKey = makeDownloadKey(source.url, source.cachePath);
+    LoadingTask& task = (*_loadingTasks)[source.key];
+    task.decoding = false;
+    task.downloadKey = downloadKey;
+    
+    // 同じURLをダウンロード中であれば、縮小するサイズが異なってもその結果を待つ
+    if( !_downloadTasks ){
+        _downloadTasks = new (std::nothrow) DownloadTaskList();
+    }
+    auto found = _downloadTasks->find(downloadKey);
+    if( found != _downloadTasks->end() ){
+        found->second.maxPixelSizes.push_back(source.maxPixelSize);
+        updateDownloadPriority(source.key);
+        return;
+    }
+    
+    // 保存されている内容があれば、変更されている場合だけ取得する
+    CacheValidator cachedValidator;
+    const bool hasCache = findCacheValidator(DiskCache::getInstance(source.cachePath), source.url, source.key, cachedValidator);
+    const std::vector<std::string> headers = hasCache? cachedValidator.makeConditionalHeaders() : std::vector<std::string>();
+    
+    DownloadTask& download = (*_downloadTasks)[downloadKey];
+    download.url = source.url;
+    download.cachePath = source.cachePath;
+    download.maxPixelSizes.push_back(source.maxPixelSize);
+    download.requestId = URLDownloader::getInstance()->request(source.url, URLDownloader::Priority::Prefetch, [downloadKey, hasCache, cachedValidator](network::HttpResponse* response){
+        
+        // ダウンロードを待っていた読み込みタスクを、縮小するサイズ毎に取り出す
+        std::vector<Source> sources;
+        {
+            auto download = _downloadTasks->find(downloadKey);
+            CC_ASSERT( download != _downloadTasks->end() );
+            for( int32_t maxPixelSize : download->second.maxPixelSizes ){
+                Source source;
+                source.url = download->second.url;
+                source.cachePath = download->second.cachePath;
+                source.maxPixelSize = maxPixelSize;
+                source.key = makeTextureKey(source.url, maxPixelSize);
+                (*_loadingTasks)[source.key].downloadKey.clear();
+                sources.push_back(source);
+            }
+            _downloadTasks->erase(download);
+            if( _downloadTasks->empty() ){
+                CC_SAFE_DELETE(_downloadTasks);
+            }
+        }
+        const std::string& url = sources.front().url;
+        const std::string& cachePath = sources.front().cachePath;
+        
+        // 変更されていなければ、ダウンロードもデコードもせずに保存されている内容を使う
+        if( hasCache && response->getResponseCode() == 304 ){
+            CCLOG("LazySprite: not modified [%s]", url.c_str());
+            const std::string metadata = CacheValidator::fromResponse(response, cachedValidator).serialize();
+            auto cache = DiskCache::getInstance(cachePath);
+            cache->setMetadata(url, metadata);
+            for( const auto& source : sources ){
+                const std::string preDecodedKey = makePreDecodedKey(source.key);
+                if( CacheValidator::parse(cache->getMetadata(preDecodedKey)).tag() == cachedValidator.tag() ){
+                    cache->setMetadata(preDecodedKey, metadata);
                 }
             }
-            CC_ASSERT( !targets.empty() );
             
-            if( response->isSucceed() ){
-                // ダウンロードしたファイルをローカルへ保存する
-                if( FileUtils::getInstance()->createDirectory( cacheFileDir ) ){
-                    FILE* file = fopen( cacheFilePath.c_str(), "wb" );
-                    fwrite( response->getResponseData()->data(), response->getResponseData()->size(), 1, file );
-                    fclose( file );
+            // 完了したタスクは取り除かれるので、先に段階を調べておく
+            std::vector<PrefetchLevel> levels;
+            for( const auto& source : sources ){
+                levels.push_back(_loadingTasks->at(source.key).level);
+            }
+            for( size_t lp = 0; lp < sources.size(); ++lp ){
+                const Source& source = sources[lp];
+                if( levels[lp] == PrefetchLevel::Disk ){
+                    finishLoading(source, true);
+                    continue;
+                }
+                // 読み込まれているテクスチャがあれば、保存されている内容をデコードし直さずに使う
+                if( s_atlasEnabled && DynamicAtlas::getInstance()->contains(source.key) ){
+                    finishLoading(source, true, nullptr, true);
+                }else if( auto texture = URLTextureCache::getInstance()->get(source.key) ){
+                    finishLoading(source, true, texture);
+                }else if( !startCacheLoad(source) ){
+                    finishLoading(source, false);
                 }
-                for( auto it : targets ){
-                    // 自分以外からの参照があれば処理
-                    if( it->getReferenceCount() > 1 ){
-                        it->addImageAsync(cacheFilePath, *response->getResponseData());
+            }
+            return;
+        }
+        
+        if( !response->isSucceed() ){
+            CCLOG("LazySprite: download failed [%ld] %s", response->getResponseCode(), url.c_str());
+            for( const auto& source : sources ){
+                finishLoading(source, false);
+            }
+            return;
+        }
+        
+        // レスポンスのバッファはコピーせずに、書き込みと全てのサイズのデコードで共有する
+        SharedBuffer data = std::make_shared<std::vector<char>>();
+        data->swap(*response->getResponseData());
+        
+        const std::string metadata = CacheValidator::fromResponse(response, CacheValidator()).serialize();
+        std::vector<Source> diskOnlySources;
+        std::vector<Source> decodeSources;
+        for( auto& source : sources ){
+            source.metadata = metadata;
+            LoadingTask& task = (*_loadingTasks)[source.key];
+            task.decoding = true;
+            if( task.level == PrefetchLevel::Disk ){
+                diskOnlySources.push_back(source);
+            }else{
+                decodeSources.push_back(source);
+            }
+        }
+        
+        // 以前のデコード済みのデータは内容が異なるので削除してから保存する
+        // (待っていない他のサイズのものは、読み込む時に ETag などを比べて取り除かれる)
+        // 先読みでディスクへの保存だけを求められていれば、保存を終えてから完了とする
+        auto written = std::make_shared<bool>(false);
+        AsyncTaskPool::getInstance()->enqueue(AsyncTaskPool::TaskType::TASK_IO, [diskOnlySources, data, written](void*){
+            for( const auto& source : diskOnlySources ){
+                // 保存している間にスプライトが待ち始めていれば、そのままデコードする
+                if( _loadingTasks ){
+                    auto it = _loadingTasks->find(source.key);
+                    if( it != _loadingTasks->end() && it->second.level != PrefetchLevel::Disk ){
+                        decodeAsync(source, data);
+                        continue;
                     }
                 }
+                finishLoading(source, *written);
+            }
+        }, nullptr, [sources, data, written](){
+            auto cache = DiskCache::getInstance(sources.front().cachePath);
+            for( const auto& source : sources ){
+                cache->remove(makePreDecodedKey(source.key));
+            }
+            *written = cache->write(sources.front().url, data->data(), data->size(), sources.front().metadata);
+        });
+        
+        // ディスクキャッシュへの保存 (TASK_IO) とデコード (TASK_OTHER) を並行して行う
+        for( const auto& source : decodeSources ){
+            decodeAsync(source, data);
+        }
+    }, headers);
+    updateDownloadPriority(source.key);
+}
+
+void LazySprite::startFileLoad(const Source& source, const std::string& filename){
+    (*_loadingTasks)[source.key].decoding = true;
+    
+    // 読み込みは TASK_IO で行い、そのままデコードのスレッドへ渡す
+    AsyncTaskPool::getInstance()->enqueue(AsyncTaskPool::TaskType::TASK_IO, [](void*){}, nullptr, [source, filename](){
+        SharedBuffer data = std::make_shared<std::vector<char>>();
+        if( source.cachePath.empty() ){
+            // パッケージ内のファイルも読めるように FileUtils を使う
+            const Data fileData = FileUtils::getInstance()->getDataFromFile(filename);
+            data->assign(fileData.getBytes(), fileData.getBytes() + fileData.getSize());
+        }else if( FILE* file = fopen(filename.c_str(), "rb") ){
+            fseek(file, 0, SEEK_END);
+            data->resize(ftell(file));
+            fseek(file, 0, SEEK_SET);
+            if( fread(data->data(), data->size(), 1, file) != 1 ){
+                data->clear();
+            }
+            fclose(file);
+        }
+        decodeAsync(source, data);
+    });
+}
+
+void LazySprite::startPreDecodedLoad(const Source& source, const std::string& filename){
+    (*_loadingTasks)[source.key].decoding = true;
+    
+    // マッピングとページの先読みは TASK_IO で行い、GLスレッドでは転送だけを行う
+    auto mapped = std::make_shared<ziputil::MappedFile>();
+    AsyncTaskPool::getInstance()->enqueue(AsyncTaskPool::TaskType::TASK_IO, [source, mapped](void*){
+        PreDecodedHeader header;
+        const unsigned char* pixels;
+        size_t dataLen;
+        if( parsePreDecoded(mapped->getData(), mapped->getSize(), header, pixels, dataLen) ){
+            // 小さな画像はアトラスへ詰め込む
+            if( s_atlasEnabled && DynamicAtlas::getInstance()->add(source.key, pixels, static_cast<Texture2D::PixelFormat>(header.pixelFormat), header.width, header.height, header.premultipliedAlpha != 0) ){
+                finishLoading(source, true, nullptr, true);
+                return;
+            }
+            if( Texture2D* texture = createTextureFromPreDecoded(header, pixels, dataLen) ){
+                finishLoading(source, true, URLTextureCache::getInstance()->add(source.key, texture));
+                texture->release();
+                return;
+            }
+        }
+        
+        // 壊れているので削除して、元のファイルから読み直す
+        DiskCache::getInstance(source.cachePath)->remove(makePreDecodedKey(source.key));
+        auto it = _loadingTasks->find(source.key);
+        if( it != _loadingTasks->end() && (!it->second.targets.empty() || !it->second.prefetchers.empty()) ){
+            startLoading(source);
+        }else{
+            finishLoading(source, false);
+        }
+    }, nullptr, [mapped, filename](){
+        // GLスレッドでページフォルトが起きないように先読みさせておく
+        if( mapped->open(filename) ){
+            mapped->prefetch();
+        }
+    });
+}
+
+void LazySprite::decodeAsync(const Source& source, const SharedBuffer& data){
+    auto image = std::make_shared<Image*>(nullptr);
+    const PreDecodedFormat preDecodedFormat = source.cachePath.empty()? PreDecodedFormat::None : s_preDecodedFormat;
+    auto task = [source, image, data, preDecodedFormat](){
+        if( !data->empty() ){
+            // 縮小しながらデコードして、デコードとアップロードの時間、テクスチャのメモリを抑える
+            *image = imageutil::decode(reinterpret_cast<const unsigned char*>(data->data()), data->size(), source.maxPixelSize);
+        }
+        if( !*image ){
+            CCLOG("LazySprite: decode failed [%s]", source.url.c_str());
+            return;
+        }
+        // 次回からデコードを省略できるように、GPUへそのまま転送できる形式を保存する
+        if( preDecodedFormat != PreDecodedFormat::None ){
+            SharedBuffer preDecoded = encodePreDecoded(*image, preDecodedFormat);
+            if( !preDecoded->empty() ){
+                AsyncTaskPool::getInstance()->enqueue(AsyncTaskPool::TaskType::TASK_IO, [](void*){}, nullptr, [source, preDecoded](){
+                    DiskCache::getInstance(source.cachePath)->write(makePreDecodedKey(source.key), preDecoded->data(), preDecoded->size(), source.metadata);
+                });
+            }
+        }
+    };
+    auto finished = [source, image](void*){
+        Texture2D* texture = nullptr;
+        if( *image ){
+            // 先読みでデコードだけを求められていれば、テクスチャは作らない
+            auto it = _loadingTasks->find(source.key);
+            if( it != _loadingTasks->end() && it->second.level != PrefetchLevel::Texture ){
+                (*image)->release();
+                finishLoading(source, true);
+                return;
+            }
+            // 小さな画像はアトラスへ詰め込む
+            if( s_atlasEnabled && DynamicAtlas::getInstance()->add(source.key, *image) ){
+                (*image)->release();
+                finishLoading(source, true, nullptr, true);
+                return;
+            }
+            // テクスチャの作成だけをGLスレッドで行う
+            texture = URLTextureCache::getInstance()->add(source.key, *image);
+            (*image)->release();
+        }else if( !source.cachePath.empty() ){
+            // 壊れたファイルを使い続けないように、キャッシュから外す
+            // 保存 (TASK_IO) より後に削除されるように、同じ TASK_IO へ積む
+            AsyncTaskPool::getInstance()->enqueue(AsyncTaskPool::TaskType::TASK_IO, [](void*){}, nullptr, [source](){
+                DiskCache::getInstance(source.cachePath)->remove(source.url);
+            });
+        }
+        finishLoading(source, texture != nullptr, texture);
+    };
+    AsyncTaskPool::getInstance()->enqueue(AsyncTaskPool::TaskType::TASK_OTHER, finished, nullptr, task);
+}
+
+void LazySprite::finishLoading(const Source& source, bool succeeded, Texture2D* texture, bool atlas){
+    std::list<LazySprite*> targets;
+    std::vector<std::function<void(bool succeeded)>> prefetchers;
+    if( _loadingTasks ){
+        auto it = _loadingTasks->find(source.key);
+        if( it != _loadingTasks->end() ){
+            targets = std::move(it->second.targets);
+            prefetchers = std::move(it->second.prefetchers);
+            _loadingTasks->erase(it);
+        }
+        if( _loadingTasks->empty() ){
+            CC_SAFE_DELETE(_loadingTasks);
+        }
+    }
+    // コールバックの中で他のスプライトが破棄されても、タスクから外れた後なので leaveLoadingTask では外せない
+    // 全て通知し終えるまで保持しておく
+    for( auto it : targets ){
+        it->retain();
+        it->_loading = false;
+    }
+    for( auto it : targets ){
+        // 自分以外からの参照があれば処理
+        if( it->getReferenceCount() > 1 ){
+            if( atlas && it->applyAtlas(source.key) ){
+                continue;
+            }
+            if( texture ){
+                it->applyTexture(texture);
             }else{
-                CCASSERT(0, cacheFilePath.c_str());
+                it->failLoading();
             }
-            
-            for( auto it : targets ){
-                it->release();
+        }
+    }
+    for( auto it : targets ){
+        it->release();
+    }
+    for( auto& it : prefetchers ){
+        it(succeeded);
+    }
+}
+
+#pragma mark -- Prefetch
+
+void LazySprite::prefetch(const std::vector<std::string>& urls, PrefetchLevel level, const ccLazySpritePrefetchCallback& callback, const ccLazySpritePrefetchProgress& progress, const std::string& cachePath, int32_t maxPixelSize){
+    if( urls.empty() ){
+        if( callback != nullptr ){
+            callback(0, 0);
+        }
+        return;
+    }
+    auto batch = std::make_shared<PrefetchBatch>();
+    batch->total = static_cast<int32_t>(urls.size());
+    batch->completed = 0;
+    batch->succeeded = 0;
+    batch->callback = callback;
+    batch->progress = progress;
+    
+    for( auto& url : urls ){
+        PrefetchItem item;
+        item.url = url;
+        item.cachePath = cachePath;
+        item.maxPixelSize = maxPixelSize;
+        item.level = level;
+        item.batch = batch;
+        _prefetchQueue.push_back(item);
+    }
+    dispatchPrefetch();
+}
+
+void LazySprite::setMaxConcurrentPrefetches(int32_t count){
+    _maxConcurrentPrefetches = std::max(count, 1);
+    dispatchPrefetch();
+}
+
+int32_t LazySprite::getMaxConcurrentPrefetches(){
+    return _maxConcurrentPrefetches;
+}
+
+void LazySprite::cancelPrefetch(const std::vector<std::string>& urls, const std::string& cachePath, int32_t maxPixelSize){
+    std::set<std::string> keys;
+    for( const auto& url : urls ){
+        keys.insert(makeTextureKey(url, maxPixelSize));
+    }
+    
+    // 待機中のものは取り除く
+    std::vector<std::shared_ptr<PrefetchBatch>> cancelled;
+    for( auto it = _prefetchQueue.begin(); it != _prefetchQueue.end(); ){
+        if( it->cachePath == cachePath && keys.count(makeTextureKey(it->url, it->maxPixelSize)) ){
+            cancelled.push_back(it->batch);
+            it = _prefetchQueue.erase(it);
+        }else{
+            ++it;
+        }
+    }
+    
+    // 読み込み中のものは結果を待つのをやめ、スプライトも待っていなければダウンロードを取り消す
+    std::vector<std::function<void(bool succeeded)>> prefetchers;
+    for( const auto& key : keys ){
+        URLTextureCache::getInstance()->unpin(key);
+        if( !_loadingTasks ){
+            continue;
+        }
+        auto it = _loadingTasks->find(key);
+        if( it == _loadingTasks->end() || it->second.prefetchers.empty() ){
+            continue;
+        }
+        std::move(it->second.prefetchers.begin(), it->second.prefetchers.end(), std::back_inserter(prefetchers));
+        it->second.prefetchers.clear();
+        removeIdleLoadingTask(key);
+    }
+    
+    for( const auto& batch : cancelled ){
+        reportPrefetch(batch, false);
+    }
+    for( auto& it : prefetchers ){
+        it(false);
+    }
+}
+
+void LazySprite::dispatchPrefetch(){
+    while( _numRunningPrefetches < _maxConcurrentPrefetches && !_prefetchQueue.empty() ){
+        const PrefetchItem item = _prefetchQueue.front();
+        _prefetchQueue.pop_front();
+        
+        Source source;
+        source.url = item.url;
+        source.cachePath = item.cachePath;
+        source.maxPixelSize = item.maxPixelSize;
+        source.key = makeTextureKey(item.url, item.maxPixelSize);
+        
+        // 作成したテクスチャは、使われる前に追い出されないようにしておく
+        const bool pin = (item.level == PrefetchLevel::Texture || (item.level == PrefetchLevel::Decode && s_preDecodedFormat == PreDecodedFormat::None));
+        const std::string key = source.key;
+        auto batch = item.batch;
+        ++_numRunningPrefetches;
+        const bool cached = startPrefetch(source, item.level, [batch, pin, key](bool succeeded){
+            --_numRunningPrefetches;
+            if( succeeded && pin ){
+                URLTextureCache::getInstance()->pin(key, PREFETCH_PIN_SECONDS);
             }
+            reportPrefetch(batch, succeeded);
+            dispatchPrefetch();
         });
-        network::HttpClient::getInstance()->sendImmediate( req );
-        req->release();
+        if( cached ){
+            --_numRunningPrefetches;
+            if( pin ){
+                URLTextureCache::getInstance()->pin(key, PREFETCH_PIN_SECONDS);
+            }
+            reportPrefetch(batch, true);
+        }
     }
 }
 
+bool LazySprite::startPrefetch(const Source& source, PrefetchLevel level, const std::function<void(bool succeeded)>& callback){
+    // 保存形式が無ければデコードしても残せないので、テクスチャまで作成する
+    if( level == PrefetchLevel::Decode && s_preDecodedFormat == PreDecodedFormat::None ){
+        level = PrefetchLevel::Texture;
+    }
+    
+    // 既に必要な段階まで読み込まれていれば何もしない
+    auto cache = DiskCache::getInstance(source.cachePath);
+    CacheValidator validator;
+    const bool fresh = findCacheValidator(cache, source.url, source.key, validator) && !validator.isStale();
+    switch( level ){
+        case PrefetchLevel::Disk:
+            if( fresh ){
+                return true;
+            }
+            break;
+        case PrefetchLevel::Decode:
+            if( fresh && cache->exists(makePreDecodedKey(source.key)) ){
+                return true;
+            }
+            break;
+        case PrefetchLevel::Texture:
+            if( (s_atlasEnabled && DynamicAtlas::getInstance()->contains(source.key)) || URLTextureCache::getInstance()->get(source.key) ){
+                return true;
+            }
+            break;
+    }
+    
+    // 同じキーを読み込み中であれば、その結果を待つ
+    if( !_loadingTasks ){
+        _loadingTasks = new (std::nothrow) LoadingTaskList();
+    }
+    auto it = _loadingTasks->find(source.key);
+    if( it != _loadingTasks->end() ){
+        it->second.prefetchers.push_back(callback);
+        it->second.level = std::max(it->second.level, level);
+        return false;
+    }
+    
+    LoadingTask& task = (*_loadingTasks)[source.key];
+    task.prefetchers.push_back(callback);
+    task.level = level;
+    task.decoding = false;
+    if( level == PrefetchLevel::Disk ){
+        startDownload(source);
+    }else{
+        startLoading(source);
+    }
+    return false;
+}
+
+std::string LazySprite::makeTextureKey(const std::string& url, int32_t maxPixelSize){
+    if( maxPixelSize > 0 ){
+        return url + "@" + StringUtils::toString(maxPixelSize);
+    }
+    return url;
+}
+
 
 #pragma mark -- LazySprite
 
 LazySprite::LazySprite()
 : _finishedCallback(nullptr)
+, _failureCallback(nullptr)
+, _placeholder(nullptr)
+, _downloadPriority(URLDownloader::Priority::Visible)
+, _loading(false)
+, _textureApplied(false)
 {}
 
 LazySprite::~LazySprite(){
+    if( _loading ){
+        leaveLoadingTask(_loadingKey, this);
+    }
+    if( !_atlasKey.empty() ){
+        DynamicAtlas::getInstance()->release(_atlasKey);
+    }
+}
+
+void LazySprite::onEnter(){
+    Sprite::onEnter();
+    if( _loading ){
+        updateDownloadPriority(_loadingKey);
+    }
 }
 
-Sprite* LazySprite::createAsync(const std::string& filename, const ccLazySpriteCallback& callback){
+void LazySprite::onExit(){
+    Sprite::onExit();
+    if( _loading ){
+        updateDownloadPriority(_loadingKey);
+    }
+}
+
+void LazySprite::setPreDecodedFormat(PreDecodedFormat format){
+    s_preDecodedFormat = format;
+}
+
+LazySprite::PreDecodedFormat LazySprite::getPreDecodedFormat(){
+    return s_preDecodedFormat;
+}
+
+void LazySprite::setRevalidationPolicy(RevalidationPolicy policy){
+    s_revalidationPolicy = policy;
+}
+
+LazySprite::RevalidationPolicy LazySprite::getRevalidationPolicy(){
+    return s_revalidationPolicy;
+}
+
+void LazySprite::setAtlasEnabled(bool enabled){
+    s_atlasEnabled = enabled;
+}
+
+bool LazySprite::isAtlasEnabled(){
+    return s_atlasEnabled;
+}
+
+void LazySprite::setDownloadPriority(URLDownloader::Priority priority){
+    if( _downloadPriority != priority ){
+        _downloadPriority = priority;
+        if( _loading ){
+            updateDownloadPriority(_loadingKey);
+        }
+    }
+}
+
+URLDownloader::Priority LazySprite::getEffectiveDownloadPriority() const {
+    // シーンに配置されていないスプライトは先読み扱いとする
+    if( !isRunning() ){
+        return URLDownloader::Priority::Prefetch;
+    }
+    return _downloadPriority;
+}
+
+LazySprite* LazySprite::createAsync(const std::string& filename, const ccLazySpriteCallback& callback, int32_t maxPixelSize){
+    LazySprite *sprite = new (std::nothrow) LazySprite();
+    if (sprite && sprite->initAsync(filename, callback, maxPixelSize))
+    {
+        sprite->autorelease();
+        return sprite;
+    }
+    delete sprite;
+    return nullptr;
+}
+
+LazySprite* LazySprite::createWithURL(const std::string& url, const ccLazySpriteCallback& callback, const std::string& cachePath, int32_t maxPixelSize){
     LazySprite *sprite = new (std::nothrow) LazySprite();
-    if (sprite && sprite->initAsync(filename, callback))
+    if (sprite && sprite->initWithURL(url, callback, cachePath, maxPixelSize))
     {
         sprite->autorelease();
         return sprite;
@@ -95,9 +1099,9 @@ Sprite* LazySprite::createAsync(const std::string& filename, const ccLazySpriteC
     return nullptr;
 }
 
-Sprite* LazySprite::createWithURL(const std::string& url, const ccLazySpriteCallback& callback, const std::string& cachePath){
+LazySprite* LazySprite::createWithURL(const std::string& url, const std::string& preview, const Size& previewSize, const ccLazySpriteCallback& callback, const std::string& cachePath, int32_t maxPixelSize){
     LazySprite *sprite = new (std::nothrow) LazySprite();
-    if (sprite && sprite->initWithURL(url, callback, cachePath))
+    if (sprite && sprite->initWithURL(url, callback, cachePath, maxPixelSize, preview, previewSize))
     {
         sprite->autorelease();
         return sprite;
@@ -106,68 +1110,171 @@ Sprite* LazySprite::createWithURL(const std::string& url, const ccLazySpriteCall
     return nullptr;
 }
 
-bool LazySprite::initAsync(const std::string& filename, const ccLazySpriteCallback& callback){
+bool LazySprite::initAsync(const std::string& filename, const ccLazySpriteCallback& callback, int32_t maxPixelSize){
     if( Sprite::init() ){
-        addImageAsync(filename);
+        _finishedCallback = callback;
+        
+        if( maxPixelSize <= 0 ){
+            addImageAsync(filename);
+            return true;
+        }
+        
+        // 縮小する場合は TextureCache を使わずに読み込む
+        Source source;
+        source.url = FileUtils::getInstance()->fullPathForFilename(filename);
+        source.maxPixelSize = maxPixelSize;
+        source.key = makeTextureKey(source.url, maxPixelSize);
+        _loadingKey = source.key;
+        
+        if( applyAtlas(source.key) ){
+            return true;
+        }
+        if( auto texture = URLTextureCache::getInstance()->get(source.key) ){
+            applyTexture(texture);
+        }else if( !joinLoadingTask(source.key, this) ){
+            startFileLoad(source, source.url);
+        }
         return true;
     }
     return false;
 }
 
-bool LazySprite::initWithURL(const std::string& url, const ccLazySpriteCallback& callback, const std::string& cachePath){
+bool LazySprite::initWithURL(const std::string& url, const ccLazySpriteCallback& callback, const std::string& cachePath, int32_t maxPixelSize, const std::string& preview, const Size& previewSize){
     if( Sprite::init() ){
         _finishedCallback = callback;
         
-        std::string cacheFileDir = FileUtils::getInstance()->getWritablePath() + cachePath;
-        if( *cacheFileDir.rbegin() != '/' ){
-            cacheFileDir.push_back('/');
-        }
+        Source source;
+        source.url = url;
+        source.cachePath = cachePath;
+        source.maxPixelSize = maxPixelSize;
+        source.key = makeTextureKey(url, maxPixelSize);
+        _loadingKey = source.key;
         
-        std::string filename;
-        const auto separator = url.rfind('/');
-        if( separator != std::string::npos ){
-            const std::string domain = url.substr(0, separator);
-            if( !domain.empty() ){
-                char* buf;
-                cocos2d::base64Encode((const unsigned char*)domain.c_str(), (unsigned int)domain.length(), &buf);
-                cacheFileDir += buf;
-                cacheFileDir.push_back('/');
-                free(buf);
-            }
-            filename = url.substr(separator+1, std::string::npos);
-            if( !filename.empty() ){
-                char* buf;
-                cocos2d::base64Encode((const unsigned char*)filename.c_str(), (unsigned int)filename.length(), &buf);
-                filename = buf;
-                free(buf);
-            }
+        // 解放されていないテクスチャがあれば、そのまま適用する
+        if( applyAtlas(source.key) ){
+            return true;
         }
-        if( filename.empty() ){
-            filename = cocos2d::StringUtils::toString( std::hash<std::string>()(url) );
+        if( auto texture = URLTextureCache::getInstance()->get(source.key) ){
+            applyTexture(texture);
+            return true;
         }
-        const std::string cacheFilePath = cacheFileDir + filename;
         
-        if( FileUtils::getInstance()->isFileExist(cacheFilePath) ){
-            addImageAsync(cacheFilePath);
-            CCLOG("cache hit [%s]", url.c_str());
-        }else{
-            requestDownload(url, cacheFilePath, cacheFileDir, this);
+        // 最初のフレームから表示されるように、読み込みを始める前にプレビューを用意する
+        if( !preview.empty() ){
+            setPlaceholder(preview, previewSize);
+        }
+        
+        // 同じキーを読み込み中であれば、その結果を待つ
+        if( !joinLoadingTask(source.key, this) ){
+            startLoading(source);
         }
         return true;
     }
     return false;
 }
 
+void LazySprite::setPlaceholder(const std::string& preview, const Size& size){
+    if( _textureApplied || size.width <= 0 || size.height <= 0 ){
+        return;
+    }
+    Image* image = nullptr;
+    if( preview.compare(0, 5, "data:") == 0 ){
+        // data URI で埋め込まれた小さな画像
+        const auto comma = preview.find(',');
+        if( comma != std::string::npos && preview.rfind(";base64", comma) != std::string::npos ){
+            unsigned char* decoded = nullptr;
+            const int length = base64Decode(reinterpret_cast<const unsigned char*>(preview.c_str() + comma + 1), static_cast<unsigned int>(preview.size() - comma - 1), &decoded);
+            if( decoded ){
+                image = imageutil::decode(decoded, length, 0);
+                free(decoded);
+            }
+        }
+    }else{
+        // BlurHash は滑らかなので、小さくデコードして拡大する
+        int width, height;
+        imageutil::fitSize(static_cast<int>(ceilf(size.width)), static_cast<int>(ceilf(size.height)), PLACEHOLDER_BLURHASH_SIZE, width, height);
+        image = imageutil::decodeBlurHash(preview, width, height);
+    }
+    if( !image ){
+        CCLOG("LazySprite: invalid placeholder [%s]", preview.c_str());
+        return;
+    }
+    Texture2D* texture = new (std::nothrow) Texture2D();
+    const bool succeeded = texture->initWithImage(image);
+#if CC_ENABLE_CACHE_TEXTURE_DATA
+    if( succeeded ){
+        VolatileTextureMgr::addImage(texture, image);
+    }
+#endif
+    image->release();
+    if( !succeeded ){
+        texture->release();
+        return;
+    }
+    
+    removePlaceholder();
+    _placeholder = Sprite::createWithTexture(texture);
+    texture->release();
+    _placeholder->setAnchorPoint(Vec2::ZERO);
+    _placeholder->setScale(size.width / _placeholder->getContentSize().width, size.height / _placeholder->getContentSize().height);
+    addChild(_placeholder, -1);
+    setContentSize(size);
+}
+
+void LazySprite::removePlaceholder(){
+    if( _placeholder ){
+        _placeholder->removeFromParent();
+        _placeholder = nullptr;
+    }
+}
+
+void LazySprite::applyTexture(Texture2D* texture){
+    _textureApplied = true;
+    removePlaceholder();
+    setTexture(texture);
+    setTextureRect(Rect(0, 0, texture->getContentSize().width, texture->getContentSize().height ));
+    if( _finishedCallback != nullptr ){
+        _finishedCallback(this);
+    }
+}
+
+void LazySprite::failLoading(){
+    if( _failureCallback != nullptr ){
+        _failureCallback(this);
+    }
+}
+
+bool LazySprite::applyAtlas(const std::string& key){
+    if( !s_atlasEnabled || !_atlasKey.empty() ){
+        return false;
+    }
+    Texture2D* texture;
+    Rect rect;
+    if( !DynamicAtlas::getInstance()->acquire(key, texture, rect) ){
+        return false;
+    }
+    _atlasKey = key;
+    _textureApplied = true;
+    removePlaceholder();
+    setTexture(texture);
+    setTextureRect(rect);
+    if( _finishedCallback != nullptr ){
+        _finishedCallback(this);
+    }
+    return true;
+}
+
 void LazySprite::addImageAsync(const std::string& filename){
     retain();
-    Director::getInstance()->getTextureCache()->addImageAsync(filename, [this](Texture2D* texture){
+    Director::getInstance()->getTextureCache()->addImageAsync(filename, [this, filename](Texture2D* texture){
         
         // 自分以外からの参照があれば処理
         if( getReferenceCount() > 1 ){
-            setTexture(texture);
-            setTextureRect(Rect(0, 0, texture->getContentSize().width, texture->getContentSize().height ));
-            if( _finishedCallback != nullptr ){
-                _finishedCallback(this);
+            if( texture ){
+                applyTexture(texture);
+            }else{
+                CCLOG("LazySprite: load failed [%s]", filename.c_str());
+                failLoading();
             }
         }
         
@@ -175,29 +1282,4 @@ void LazySprite::addImageAsync(const std::string& filename){
     });
 }
 
-void LazySprite::addImageAsync(std::string filename, const std::vector<char>& data){
-    retain();
-    auto it = _work.emplace(_work.end(), std::move(filename), data, nullptr);
-    //
-    auto task = [this, it](){
-        const std::vector<char>& data = std::get<1>(*it);
-        Image* image = new (std::nothrow) Image();
-        image->initWithImageData(reinterpret_cast<const unsigned char*>(data.data()), data.size());
-        std::get<2>(*it) = image;
-    };
-    auto finished = [this, it](void*){
-        // 自分以外からの参照があれば処理
-        if( getReferenceCount() > 1 ){
-            Texture2D* texture = Director::getInstance()->getTextureCache()->addImage(std::get<2>(*it), std::get<0>(*it));
-            setTexture(texture);
-            setTextureRect(Rect(0, 0, texture->getContentSize().width, texture->getContentSize().height ));
-            if( _finishedCallback != nullptr ){
-                _finishedCallback( this );
-            }
-        }
-        _work.erase(it);
-    };
-    AsyncTaskPool::getInstance()->enqueue(AsyncTaskPool::TaskType::TASK_OTHER, finished, nullptr, task);
-}
-
 NS_CC_EXT_END
@@ -7,11 +7,14 @@
 
 #include "cocos2d.h"
 #include "cocos-ext.h"
+#include "CCURLDownloader.h"
 
 
 NS_CC_EXT_BEGIN
 
 typedef std::function<void(Sprite* sprite)> ccLazySpriteCallback;
+typedef std::function<void(int32_t completed, int32_t total)> ccLazySpritePrefetchProgress;
+typedef std::function<void(int32_t succeeded, int32_t total)> ccLazySpritePrefetchCallback;
 
 /**
  * <img>のように扱えるスプライト
@@ -21,33 +24,182 @@ class LazySprite
 {
 public:
     
+    /**
+     * デコード結果をGPUへそのまま転送できる形式で保存する場合の形式
+     */
+    enum class PreDecodedFormat {
+        /// 保存しない
+        None,
+        /// 不透明なら RGB888、半透明があれば RGBA8888
+        Auto,
+        /// 不透明なら RGB565、半透明があれば RGBA8888
+        RGB565,
+    };
+    
+    /**
+     * 先読みの段階
+     */
+    enum class PrefetchLevel {
+        /// DiskCache へダウンロードする
+        Disk,
+        /// デコードして、GPUへそのまま転送できる形式で DiskCache へ保存する (PreDecodedFormat が None であれば Texture と同じ)
+        Decode,
+        /// テクスチャを作成して URLTextureCache (アトラスが有効であれば DynamicAtlas) へ登録する
+        /// URLTextureCache のテクスチャは、使われるまで60秒の間は解放されない
+        Texture,
+    };
+    
+    /**
+     * DiskCache に保存したファイルを、サーバーへ問い合わせて再検証する条件
+     * 問い合わせには ETag (If-None-Match) と Last-Modified (If-Modified-Since) を使い、
+     * 変更されていなければ (304) 保存されている内容をそのまま使う
+     */
+    enum class RevalidationPolicy {
+        /// 再検証しない
+        Never,
+        /// Cache-Control の max-age が過ぎていれば再検証する。max-age が無ければ、ETag か Last-Modified がある場合に限って1日後から再検証する
+        Expired,
+        /// 読み込む度に再検証する
+        Always,
+    };
+    
     /**
      * urlで指定された画像ファイルをダウンロードし、テクスチャの非同期読み込みが完了したら自身へ適用するスプライトを生成
+     * ダウンロードしたファイルは cachePath の DiskCache へ、テクスチャは URLTextureCache へ保存される
+     * URLTextureCache にテクスチャが残っていれば、生成時に適用される
+     * @param maxPixelSize 0以外であれば、長辺がこのサイズ以下になるように縮小してデコードする
      * @return  An autoreleased sprite object.
      */
-    static Sprite* createWithURL(const std::string& url, const ccLazySpriteCallback& callback = nullptr, const std::string& cachePath = "LazySprite/");
+    static LazySprite* createWithURL(const std::string& url, const ccLazySpriteCallback& callback = nullptr, const std::string& cachePath = "LazySprite/", int32_t maxPixelSize = 0);
+    
+    /**
+     * 読み込みが終わるまでプレビューを表示する createWithURL
+     * プレビューは生成時にGLスレッドでデコードされ、テクスチャが適用されると取り除かれる (テクスチャが残っていれば表示しない)
+     * @param preview BlurHash の文字列、もしくは "data:image/jpeg;base64,..." のような data URI で表した小さな画像
+     * @param previewSize 表示するサイズ (points)
+     */
+    static LazySprite* createWithURL(const std::string& url, const std::string& preview, const Size& previewSize, const ccLazySpriteCallback& callback = nullptr, const std::string& cachePath = "LazySprite/", int32_t maxPixelSize = 0);
     
     /**
      * filenameで指定されたテクスチャの非同期読み込みが完了したら自身へ適用するスプライトを生成
+     * @param maxPixelSize 0以外であれば、長辺がこのサイズ以下になるように縮小してデコードする
      * @return  An autoreleased sprite object.
      */
-    static Sprite* createAsync(const std::string& filename, const ccLazySpriteCallback& callback = nullptr);
+    static LazySprite* createAsync(const std::string& filename, const ccLazySpriteCallback& callback = nullptr, int32_t maxPixelSize = 0);
+    
+    /**
+     * 次に表示する画像を、スプライトを生成せずに level の段階まで読み込んでおく
+     * ダウンロードは URLDownloader::Priority::Prefetch で行われ、同時に処理する数は setMaxConcurrentPrefetches で制限される
+     * @param callback 全て終わったら、成功した数と共にGLスレッドで呼ばれる
+     * @param progress 1つ終わる毎にGLスレッドで呼ばれる
+     */
+    static void prefetch(const std::vector<std::string>& urls, PrefetchLevel level, const ccLazySpritePrefetchCallback& callback = nullptr, const ccLazySpritePrefetchProgress& progress = nullptr, const std::string& cachePath = "LazySprite/", int32_t maxPixelSize = 0);
+    
+    /**
+     * prefetch で登録した urls の先読みを取り消す (cachePath と maxPixelSize は prefetch と同じものを指定する)
+     * 待機中や読み込み中のものは失敗として進捗が報告され、読み込んだテクスチャの pin は解除される
+     * スプライトが待っている読み込みは取り消されない
+     */
+    static void cancelPrefetch(const std::vector<std::string>& urls, const std::string& cachePath = "LazySprite/", int32_t maxPixelSize = 0);
+    
+    /**
+     * 同時に処理する先読みの数を設定 (default: 2)
+     */
+    static void setMaxConcurrentPrefetches(int32_t count);
+    static int32_t getMaxConcurrentPrefetches();
+    
+    /**
+     * ダウンロードの優先度を設定
+     * シーンに配置されていない間は URLDownloader::Priority::Prefetch として扱われる
+     */
+    void setDownloadPriority(URLDownloader::Priority priority);
+    inline URLDownloader::Priority getDownloadPriority() const { return _downloadPriority; }
+    
+    /**
+     * 読み込みに失敗した時に呼ばれるコールバックを設定 (生成時の callback はテクスチャを適用した時だけ呼ばれる)
+     */
+    void setFailureCallback(const ccLazySpriteCallback& callback){ _failureCallback = callback; }
+    
+    /**
+     * デコード結果の保存形式を設定 (default: None)
+     * 保存されたデータは DiskCache へ元のファイルとは別に記録され、次回からはデコードせずにメモリマップして転送される
+     */
+    static void setPreDecodedFormat(PreDecodedFormat format);
+    static PreDecodedFormat getPreDecodedFormat();
+    
+    /**
+     * DiskCache に保存したファイルの再検証の条件を設定 (default: Never)
+     */
+    static void setRevalidationPolicy(RevalidationPolicy policy);
+    static RevalidationPolicy getRevalidationPolicy();
+    
+    /**
+     * 小さな画像を DynamicAtlas へ詰め込む (default: false)
+     * 詰め込む画像のサイズは DynamicAtlas::setMaxImageSize で設定する
+     */
+    static void setAtlasEnabled(bool enabled);
+    static bool isAtlasEnabled();
+    
+    // Node
+    virtual void onEnter() override;
+    virtual void onExit() override;
     
 CC_CONSTRUCTOR_ACCESS:
     
     LazySprite();
     virtual ~LazySprite();
     
-    bool initWithURL(const std::string& url, const ccLazySpriteCallback& callback, const std::string& cachePath);
-    bool initAsync(const std::string& filename, const ccLazySpriteCallback& callback);
+    bool initWithURL(const std::string& url, const ccLazySpriteCallback& callback, const std::string& cachePath, int32_t maxPixelSize = 0, const std::string& preview = "", const Size& previewSize = Size::ZERO);
+    bool initAsync(const std::string& filename, const ccLazySpriteCallback& callback, int32_t maxPixelSize = 0);
     
 private:
-    static void requestDownload(const std::string& url, const std::string& cacheFilePath, const std::string& cacheFileDir, LazySprite* target);
+    typedef std::shared_ptr<std::vector<char>> SharedBuffer;
+    
+    /**
+     * 読み込み元の情報
+     */
+    struct Source {
+        /// URL もしくはローカルファイルのフルパス
+        std::string url;
+        /// DiskCacheの場所 (ローカルファイルであれば空)
+        std::string cachePath;
+        int32_t maxPixelSize;
+        /// URLTextureCache と読み込みタスクのキー
+        std::string key;
+        /// DiskCache へ記録する再検証のための情報
+        std::string metadata;
+    };
+    
+    static std::string makeTextureKey(const std::string& url, int32_t maxPixelSize);
+    static bool joinLoadingTask(const std::string& key, LazySprite* target);
+    static void leaveLoadingTask(const std::string& key, LazySprite* target);
+    static void removeIdleLoadingTask(const std::string& key);
+    static void updateDownloadPriority(const std::string& key);
+    static void startLoading(const Source& source);
+    static bool startCacheLoad(const Source& source);
+    static void startDownload(const Source& source);
+    static void startFileLoad(const Source& source, const std::string& filename);
+    static void startPreDecodedLoad(const Source& source, const std::string& filename);
+    static void decodeAsync(const Source& source, const SharedBuffer& data);
+    static void finishLoading(const Source& source, bool succeeded, Texture2D* texture = nullptr, bool atlas = false);
+    static bool startPrefetch(const Source& source, PrefetchLevel level, const std::function<void(bool succeeded)>& callback);
+    static void dispatchPrefetch();
+    URLDownloader::Priority getEffectiveDownloadPriority() const;
     void addImageAsync(const std::string& filename);
-    void addImageAsync(std::string filename, const std::vector<char>& data);
+    void applyTexture(Texture2D* texture);
+    void failLoading();
+    void setPlaceholder(const std::string& preview, const Size& size);
+    void removePlaceholder();
+    bool applyAtlas(const std::string& key);
     
     ccLazySpriteCallback _finishedCallback;
-    std::list<std::tuple<std::string, std::vector<char>, Image*>> _work;
+    ccLazySpriteCallback _failureCallback;
+    std::string _loadingKey;
+    std::string _atlasKey;
+    Sprite* _placeholder;
+    URLDownloader::Priority _downloadPriority;
+    bool _loading;
+    bool _textureApplied;
 };
 
 NS_CC_EXT_END
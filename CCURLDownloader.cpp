@@ -0,0 +1,130 @@
+/****************************************************************************
+ Copyright (c) Yassy
+ https://github.com/yassy0413/cocos2dx-3.x-util
+ ****************************************************************************/
+#include "CCURLDownloader.h"
+
+NS_CC_EXT_BEGIN
+
+static URLDownloader *s_pURLDownloader = nullptr; // pointer to singleton
+
+URLDownloader* URLDownloader::getInstance(){
+    if (s_pURLDownloader == nullptr) {
+        s_pURLDownloader = new (std::nothrow) URLDownloader();
+    }
+    return s_pURLDownloader;
+}
+
+void URLDownloader::destroyInstance(){
+    CC_SAFE_DELETE(s_pURLDownloader);
+}
+
+URLDownloader::URLDownloader()
+: _nextId(0)
+, _nextOrder(0)
+, _numRunning(0)
+, _maxConcurrentRequests(4)
+{}
+
+URLDownloader::~URLDownloader(){
+}
+
+void URLDownloader::setMaxConcurrentRequests(int32_t count){
+    CC_ASSERT(count > 0);
+    _maxConcurrentRequests = count;
+    dispatch();
+}
+
+URLDownloader::PendingKey URLDownloader::makePendingKey(RequestId id, const Request& request){
+    return PendingKey(std::make_pair(static_cast<int32_t>(request.priority), request.order), id);
+}
+
+URLDownloader::RequestId URLDownloader::request(const std::string& url, Priority priority, const Callback& callback, const std::vector<std::string>& headers){
+    const RequestId id = ++_nextId;
+    Request& request = _requests[id];
+    request.url = url;
+    request.headers = headers;
+    request.callback = callback;
+    request.priority = priority;
+    request.order = _nextOrder++;
+    request.running = false;
+    _pending.insert(makePendingKey(id, request));
+    
+    dispatch();
+    return id;
+}
+
+void URLDownloader::setPriority(RequestId id, Priority priority){
+    auto it = _requests.find(id);
+    if( it == _requests.end() || it->second.priority == priority ){
+        return;
+    }
+    if( it->second.running ){
+        it->second.priority = priority;
+        return;
+    }
+    // 同じ優先度の中では、登録された順を維持する
+    _pending.erase(makePendingKey(id, it->second));
+    it->second.priority = priority;
+    _pending.insert(makePendingKey(id, it->second));
+}
+
+void URLDownloader::cancel(RequestId id){
+    auto it = _requests.find(id);
+    if( it == _requests.end() ){
+        return;
+    }
+    const bool running = it->second.running;
+    if( !running ){
+        _pending.erase(makePendingKey(id, it->second));
+    }
+    _requests.erase(it);
+    // 送信済みであれば通信の完了を待たずに枠を空け、遅れて届いた結果は捨てる
+    if( running ){
+        --_numRunning;
+        dispatch();
+    }
+}
+
+void URLDownloader::dispatch(){
+    while( _numRunning < _maxConcurrentRequests && !_pending.empty() ){
+        const RequestId id = _pending.begin()->second;
+        _pending.erase(_pending.begin());
+        send(id, _requests[id]);
+    }
+}
+
+void URLDownloader::send(RequestId id, Request& request){
+    request.running = true;
+    ++_numRunning;
+    
+    auto req = new (std::nothrow) network::HttpRequest();
+    req->setRequestType(network::HttpRequest::Type::GET);
+    req->setUrl(request.url);
+    if( !request.headers.empty() ){
+        req->setHeaders(request.headers);
+    }
+    req->setResponseCallback([id](network::HttpClient* client, network::HttpResponse* response){
+        auto self = s_pURLDownloader;
+        if( !self ){
+            return;
+        }
+        
+        // キャンセルされたリクエストは、キャンセルした時に枠を空けている
+        auto it = self->_requests.find(id);
+        if( it == self->_requests.end() ){
+            return;
+        }
+        --self->_numRunning;
+        const Callback callback = std::move(it->second.callback);
+        self->_requests.erase(it);
+        if( callback ){
+            callback(response);
+        }
+        self->dispatch();
+    });
+    network::HttpClient::getInstance()->sendImmediate(req);
+    req->release();
+}
+
+NS_CC_EXT_END
@@ -0,0 +1,111 @@
+/****************************************************************************
+ Copyright (c) Yassy
+ https://github.com/yassy0413/cocos2dx-3.x-util
+ ****************************************************************************/
+#ifndef __CC_URL_DOWNLOADER_H__
+#define __CC_URL_DOWNLOADER_H__
+
+#include "cocos2d.h"
+#include "ExtensionMacros.h"
+#include "network/HttpClient.h"
+#include <set>
+
+NS_CC_EXT_BEGIN
+
+/**
+ * 同時接続数と優先度を制御するダウンロードスケジューラ
+ *
+ * 待機中のリクエストは優先度の高いものから、登録された順に送信される。
+ * 送信済みのリクエストをキャンセルした場合、通信は継続するがコールバックは呼ばれず、同時接続数の枠はすぐに空けられる。
+ *
+ @code
+ auto id = URLDownloader::getInstance()->request(url, URLDownloader::Priority::Visible, myCallback);
+ URLDownloader::getInstance()->cancel(id);
+ @endcode
+ */
+class URLDownloader
+{
+public:
+    CC_DISALLOW_COPY_AND_ASSIGN(URLDownloader);
+    
+    /**
+     * 優先度 (上にあるものほど優先される)
+     */
+    enum class Priority {
+        /// 表示中
+        Visible,
+        /// もうすぐ表示される
+        NearVisible,
+        /// 先読み
+        Prefetch,
+    };
+    
+    typedef uint32_t RequestId;
+    typedef std::function<void(network::HttpResponse* response)> Callback;
+    
+    /** Return the shared instance **/
+    static URLDownloader *getInstance();
+    
+    /** Relase the shared instance **/
+    static void destroyInstance();
+    
+    /**
+     * 同時接続数の上限を設定
+     */
+    void setMaxConcurrentRequests(int32_t count);
+    inline int32_t getMaxConcurrentRequests() const { return _maxConcurrentRequests; }
+    
+    /**
+     * リクエストを登録する。コールバックはGLスレッドで呼ばれる
+     */
+    RequestId request(const std::string& url, Priority priority, const Callback& callback, const std::vector<std::string>& headers = {});
+    
+    /**
+     * 待機中のリクエストの優先度を変更する
+     */
+    void setPriority(RequestId id, Priority priority);
+    
+    /**
+     * リクエストをキャンセルする
+     */
+    void cancel(RequestId id);
+    
+    /**
+     * 待機中のリクエスト数
+     */
+    int32_t getNumPendingRequests() const { return static_cast<int32_t>(_pending.size()); }
+    
+    /**
+     * 送信中のリクエスト数 (キャンセルしたものは含まない)
+     */
+    int32_t getNumRunningRequests() const { return _numRunning; }
+
+private:
+    struct Request {
+        std::string url;
+        std::vector<std::string> headers;
+        Callback callback;
+        Priority priority;
+        uint64_t order;
+        bool running;
+    };
+    typedef std::pair<std::pair<int32_t, uint64_t>, RequestId> PendingKey;
+    
+    URLDownloader();
+    ~URLDownloader();
+    
+    static PendingKey makePendingKey(RequestId id, const Request& request);
+    void dispatch();
+    void send(RequestId id, Request& request);
+    
+    std::unordered_map<RequestId, Request> _requests;
+    std::set<PendingKey> _pending;
+    RequestId _nextId;
+    uint64_t _nextOrder;
+    int32_t _numRunning;
+    int32_t _maxConcurrentRequests;
+};
+
+NS_CC_EXT_END
+
+#endif
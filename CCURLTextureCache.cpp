@@ -0,0 +1,159 @@
+/****************************************************************************
+ Copyright (c) Yassy
+ https://github.com/yassy0413/cocos2dx-3.x-util
+ ****************************************************************************/
+#include "CCURLTextureCache.h"
+
+NS_CC_EXT_BEGIN
+
+static URLTextureCache *s_pURLTextureCache = nullptr; // pointer to singleton
+
+URLTextureCache* URLTextureCache::getInstance(){
+    if (s_pURLTextureCache == nullptr) {
+        s_pURLTextureCache = new (std::nothrow) URLTextureCache();
+    }
+    return s_pURLTextureCache;
+}
+
+void URLTextureCache::destroyInstance(){
+    CC_SAFE_DELETE(s_pURLTextureCache);
+}
+
+URLTextureCache::URLTextureCache()
+: _capacity(32 * 1024 * 1024)
+, _bytes(0)
+, _hits(0)
+, _misses(0)
+, _evictions(0)
+{}
+
+URLTextureCache::~URLTextureCache(){
+    for( auto& it : _entries ){
+        it.second.texture->release();
+    }
+}
+
+size_t URLTextureCache::getTextureBytes(Texture2D* texture){
+    return static_cast<size_t>(texture->getPixelsWide()) * texture->getPixelsHigh() * texture->getBitsPerPixelForFormat() / 8;
+}
+
+void URLTextureCache::setCapacity(size_t bytes){
+    _capacity = bytes;
+    trim(_capacity);
+}
+
+Texture2D* URLTextureCache::get(const std::string& key){
+    auto it = _entries.find(key);
+    if( it == _entries.end() ){
+        ++_misses;
+        return nullptr;
+    }
+    ++_hits;
+    _lru.splice(_lru.begin(), _lru, it->second.lru);
+    it->second.pinnedUntil = std::chrono::steady_clock::time_point();
+    return it->second.texture;
+}
+
+Texture2D* URLTextureCache::add(const std::string& key, Texture2D* texture){
+    auto it = _entries.find(key);
+    if( it != _entries.end() ){
+        _lru.splice(_lru.begin(), _lru, it->second.lru);
+        return it->second.texture;
+    }
+    texture->retain();
+    Entry& entry = _entries[key];
+    entry.texture = texture;
+    entry.bytes = getTextureBytes(texture);
+    entry.lru = _lru.insert(_lru.begin(), key);
+    entry.pinnedUntil = std::chrono::steady_clock::time_point();
+    _bytes += entry.bytes;
+    
+    trim(_capacity);
+    return texture;
+}
+
+Texture2D* URLTextureCache::add(const std::string& key, Image* image){
+    auto it = _entries.find(key);
+    if( it != _entries.end() ){
+        _lru.splice(_lru.begin(), _lru, it->second.lru);
+        return it->second.texture;
+    }
+    auto texture = new (std::nothrow) Texture2D();
+    if( !texture || !texture->initWithImage(image) ){
+        CC_SAFE_RELEASE(texture);
+        return nullptr;
+    }
+#if CC_ENABLE_CACHE_TEXTURE_DATA
+    // TextureCache を通さないので、コンテキストを失った時に作り直せるように登録する (解除は Texture2D のデストラクタで行われる)
+    VolatileTextureMgr::addImage(texture, image);
+#endif
+    add(key, texture);
+    texture->release();
+    return texture;
+}
+
+void URLTextureCache::remove(const std::string& key){
+    auto it = _entries.find(key);
+    if( it != _entries.end() ){
+        _bytes -= it->second.bytes;
+        _lru.erase(it->second.lru);
+        it->second.texture->release();
+        _entries.erase(it);
+    }
+}
+
+void URLTextureCache::pin(const std::string& key, float seconds){
+    auto it = _entries.find(key);
+    if( it != _entries.end() ){
+        const auto duration = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(seconds));
+        it->second.pinnedUntil = std::chrono::steady_clock::now() + duration;
+    }
+}
+
+void URLTextureCache::unpin(const std::string& key){
+    auto it = _entries.find(key);
+    if( it != _entries.end() ){
+        it->second.pinnedUntil = std::chrono::steady_clock::time_point();
+    }
+}
+
+void URLTextureCache::purge(){
+    for( auto& it : _entries ){
+        it.second.pinnedUntil = std::chrono::steady_clock::time_point();
+    }
+    trim(0);
+}
+
+URLTextureCache::Stats URLTextureCache::getStats() const {
+    Stats stats;
+    stats.hits = _hits;
+    stats.misses = _misses;
+    stats.evictions = _evictions;
+    stats.count = static_cast<uint32_t>(_entries.size());
+    stats.bytes = _bytes;
+    return stats;
+}
+
+void URLTextureCache::resetStats(){
+    _hits = _misses = _evictions = 0;
+}
+
+void URLTextureCache::trim(size_t capacity){
+    // 古いものから順に、キャッシュ以外から参照されておらず、pin されていないテクスチャを解放する
+    const auto now = std::chrono::steady_clock::now();
+    for( auto it = _lru.rbegin(); it != _lru.rend() && _bytes > capacity; ){
+        auto entry = _entries.find(*it);
+        if( entry->second.texture->getReferenceCount() > 1 || entry->second.pinnedUntil > now ){
+            ++it;
+            continue;
+        }
+        CCLOG("URLTextureCache evict [%s]", it->c_str());
+        _bytes -= entry->second.bytes;
+        entry->second.texture->release();
+        _entries.erase(entry);
+        it = std::list<std::string>::reverse_iterator(_lru.erase(std::next(it).base()));
+        ++_evictions;
+    }
+}
+
+NS_CC_EXT_END
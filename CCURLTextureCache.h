@@ -0,0 +1,119 @@
+/****************************************************************************
+ Copyright (c) Yassy
+ https://github.com/yassy0413/cocos2dx-3.x-util
+ ****************************************************************************/
+#ifndef __CC_URL_TEXTURE_CACHE_H__
+#define __CC_URL_TEXTURE_CACHE_H__
+
+#include "cocos2d.h"
+#include "ExtensionMacros.h"
+#include <chrono>
+
+NS_CC_EXT_BEGIN
+
+/**
+ * 容量制限付きのURLテクスチャキャッシュ
+ *
+ * 使用量が上限を超えた場合、キャッシュ以外から参照されていないテクスチャを
+ * 最後に使われた順が古いものから解放する。
+ * GLスレッドからのみ利用すること。
+ */
+class URLTextureCache
+{
+public:
+    CC_DISALLOW_COPY_AND_ASSIGN(URLTextureCache);
+    
+    /**
+     * 統計情報
+     */
+    struct Stats {
+        uint32_t hits;
+        uint32_t misses;
+        uint32_t evictions;
+        uint32_t count;
+        size_t bytes;
+    };
+    
+    /** Return the shared instance **/
+    static URLTextureCache *getInstance();
+    
+    /** Relase the shared instance **/
+    static void destroyInstance();
+    
+    /**
+     * 容量の上限 (bytes) を設定。超過していれば未参照のテクスチャを解放する
+     */
+    void setCapacity(size_t bytes);
+    inline size_t getCapacity() const { return _capacity; }
+    
+    /**
+     * keyに対応するテクスチャを取得
+     * @return 未キャッシュであれば nullptr
+     */
+    Texture2D* get(const std::string& key);
+    
+    /**
+     * テクスチャを登録する。既に登録済みであれば、登録済みのテクスチャを返す
+     */
+    Texture2D* add(const std::string& key, Texture2D* texture);
+    
+    /**
+     * imageからテクスチャを作成して登録する
+     */
+    Texture2D* add(const std::string& key, Image* image);
+    
+    /**
+     * keyのテクスチャをキャッシュから外す
+     */
+    void remove(const std::string& key);
+    
+    /**
+     * keyのテクスチャを seconds 秒の間、未参照でも解放しないようにする
+     * 先読みしたテクスチャが、使われる前に追い出されないようにするために使う。get で取得されると解除される
+     */
+    void pin(const std::string& key, float seconds);
+    void unpin(const std::string& key);
+    
+    /**
+     * 未参照のテクスチャを全て解放する (pin されたものも含む)
+     */
+    void purge();
+    
+    /**
+     * 統計情報を取得
+     */
+    Stats getStats() const;
+    void resetStats();
+    
+    /**
+     * テクスチャの使用メモリ量を取得
+     */
+    static size_t getTextureBytes(Texture2D* texture);
+
+private:
+    struct Entry {
+        Texture2D* texture;
+        size_t bytes;
+        std::list<std::string>::iterator lru;
+        /// この時刻までは解放しない
+        std::chrono::steady_clock::time_point pinnedUntil;
+    };
+    
+    URLTextureCache();
+    ~URLTextureCache();
+    
+    void trim(size_t capacity);
+    
+    std::unordered_map<std::string, Entry> _entries;
+    /// 先頭が最も新しい
+    std::list<std::string> _lru;
+    size_t _capacity;
+    size_t _bytes;
+    uint32_t _hits;
+    uint32_t _misses;
+    uint32_t _evictions;
+};
+
+NS_CC_EXT_END
+
+#endif
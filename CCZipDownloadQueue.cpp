@@ -0,0 +1,231 @@
+/****************************************************************************
+ Copyright (c) Yassy
+ https://github.com/yassy0413/cocos2dx-3.x-util
+ ****************************************************************************/
+#include "CCZipDownloadQueue.h"
+
+NS_CC_EXT_BEGIN
+
+static ZipDownloadQueue *s_pZipDownloadQueue = nullptr; // pointer to singleton
+/// 生成したインスタンスの数
+static uint32_t s_generation = 0;
+
+ZipDownloadQueue* ZipDownloadQueue::getInstance(){
+    if (s_pZipDownloadQueue == nullptr) {
+        s_pZipDownloadQueue = new (std::nothrow) ZipDownloadQueue();
+    }
+    return s_pZipDownloadQueue;
+}
+
+void ZipDownloadQueue::destroyInstance(){
+    CC_SAFE_DELETE(s_pZipDownloadQueue);
+}
+
+ZipDownloadQueue::ZipDownloadQueue()
+: _generation(++s_generation)
+, _nextId(0)
+, _nextOrder(0)
+, _numRunning(0)
+, _maxConcurrentDownloads(2)
+{}
+
+ZipDownloadQueue::~ZipDownloadQueue(){
+    // 実行中のダウンロードは中断し、途中までのファイルは次回のために残す
+    for( auto& pair : _jobs ){
+        if( pair.second.running ){
+            *pair.second.abortFlag = true;
+        }
+    }
+}
+
+void ZipDownloadQueue::setMaxConcurrentDownloads(int32_t count){
+    CC_ASSERT(count > 0);
+    _maxConcurrentDownloads = count;
+    dispatch();
+}
+
+ZipDownloadQueue::PendingKey ZipDownloadQueue::makePendingKey(JobId id, const Job& job){
+    return PendingKey(std::make_pair(static_cast<int32_t>(job.priority), job.order), id);
+}
+
+std::string ZipDownloadQueue::makeJobKey(const std::string& url, const std::string& outdir){
+    return url + "\n" + outdir;
+}
+
+ZipDownloadQueue::JobId ZipDownloadQueue::enqueue(const std::string& url, const std::string& outdir, Priority priority, const ccZipDownloaderCallback& callback, const ZipDownloader::Options& options){
+    const std::string key = makeJobKey(url, outdir);
+    auto found = _jobKeys.find(key);
+    if( found != _jobKeys.end() ){
+        const JobId id = found->second;
+        Job& job = _jobs[id];
+        // キャンセル中のジョブは、中断を終えてから続きをダウンロードし直す
+        if( job.cancelled ){
+            job.cancelled = false;
+            job.options = options;
+        }
+        job.callbacks.push_back(callback);
+        if( priority < job.priority ){
+            setPriority(id, priority);
+        }
+        return id;
+    }
+    
+    const JobId id = ++_nextId;
+    Job& job = _jobs[id];
+    job.url = url;
+    job.outdir = outdir;
+    job.options = options;
+    job.callbacks.push_back(callback);
+    job.priority = priority;
+    job.order = _nextOrder++;
+    job.running = false;
+    job.paused = false;
+    job.cancelled = false;
+    _jobKeys[key] = id;
+    _pending.insert(makePendingKey(id, job));
+    
+    dispatch();
+    return id;
+}
+
+void ZipDownloadQueue::setPriority(JobId id, Priority priority){
+    auto it = _jobs.find(id);
+    if( it == _jobs.end() || it->second.priority == priority ){
+        return;
+    }
+    Job& job = it->second;
+    const bool pending = !job.running && !job.paused;
+    if( pending ){
+        _pending.erase(makePendingKey(id, job));
+    }
+    // 同じ優先度の中では、登録された順を維持する
+    job.priority = priority;
+    if( pending ){
+        _pending.insert(makePendingKey(id, job));
+    }
+}
+
+void ZipDownloadQueue::cancel(JobId id){
+    auto it = _jobs.find(id);
+    if( it == _jobs.end() || it->second.cancelled ){
+        return;
+    }
+    Job& job = it->second;
+    if( job.running ){
+        // 中断を終えてから削除する
+        job.cancelled = true;
+        job.paused = false;
+        job.callbacks.clear();
+        *job.abortFlag = true;
+        return;
+    }
+    if( !job.paused ){
+        _pending.erase(makePendingKey(id, job));
+    }
+    const std::string spool = job.outdir + ".zipdownload";
+    ::remove(spool.c_str());
+    ::remove((spool + ".info").c_str());
+    erase(it);
+}
+
+void ZipDownloadQueue::pause(JobId id){
+    auto it = _jobs.find(id);
+    if( it == _jobs.end() || it->second.paused || it->second.cancelled ){
+        return;
+    }
+    Job& job = it->second;
+    job.paused = true;
+    if( job.running ){
+        *job.abortFlag = true;
+    }else{
+        _pending.erase(makePendingKey(id, job));
+    }
+}
+
+void ZipDownloadQueue::resume(JobId id){
+    auto it = _jobs.find(id);
+    if( it == _jobs.end() || !it->second.paused ){
+        return;
+    }
+    Job& job = it->second;
+    job.paused = false;
+    // 中断を終えていなければ、終えてから待機中に戻す
+    if( !job.running ){
+        _pending.insert(makePendingKey(id, job));
+        dispatch();
+    }
+}
+
+bool ZipDownloadQueue::isPaused(JobId id) const {
+    auto it = _jobs.find(id);
+    return it != _jobs.end() && it->second.paused;
+}
+
+void ZipDownloadQueue::dispatch(){
+    while( _numRunning < _maxConcurrentDownloads && !_pending.empty() ){
+        const JobId id = _pending.begin()->second;
+        _pending.erase(_pending.begin());
+        start(id, _jobs[id]);
+    }
+}
+
+void ZipDownloadQueue::start(JobId id, Job& job){
+    job.running = true;
+    job.abortFlag = std::make_shared<std::atomic<bool>>(false);
+    ++_numRunning;
+    
+    ZipDownloader::Options options = job.options;
+    options.abortFlag = job.abortFlag;
+    // 一時停止しても続きから再開できるようにする
+    if( !options.streaming ){
+        options.resumable = true;
+    }
+    auto abortFlag = job.abortFlag;
+    const uint32_t generation = _generation;
+    ZipDownloader::getInstance()->download(job.url, job.outdir, [id, abortFlag, generation](bool succeeded){
+        // destroyInstance の後に作り直されたインスタンスでは、ジョブのIDが重なるので受け取らない
+        auto self = s_pZipDownloadQueue;
+        if( self && self->_generation == generation ){
+            self->onFinished(id, abortFlag, succeeded);
+        }
+    }, options);
+}
+
+void ZipDownloadQueue::onFinished(JobId id, const std::shared_ptr<std::atomic<bool>>& abortFlag, bool succeeded){
+    --_numRunning;
+    auto it = _jobs.find(id);
+    if( it != _jobs.end() ){
+        Job& job = it->second;
+        job.running = false;
+        if( job.cancelled ){
+            const std::string spool = job.outdir + ".zipdownload";
+            ::remove(spool.c_str());
+            ::remove((spool + ".info").c_str());
+            erase(it);
+        }else if( !succeeded && *abortFlag ){
+            // 一時停止で中断したジョブは、再開されていれば待機中に戻す
+            if( !job.paused ){
+                _pending.insert(makePendingKey(id, job));
+            }
+        }else{
+            const std::vector<ccZipDownloaderCallback> callbacks = std::move(job.callbacks);
+            erase(it);
+            for( const auto& callback : callbacks ){
+                if( callback ){
+                    callback(succeeded);
+                }
+            }
+        }
+    }
+    // コールバックの中で destroyInstance されていれば何もしない
+    if( s_pZipDownloadQueue == this ){
+        dispatch();
+    }
+}
+
+void ZipDownloadQueue::erase(std::unordered_map<JobId, Job>::iterator it){
+    _jobKeys.erase(makeJobKey(it->second.url, it->second.outdir));
+    _jobs.erase(it);
+}
+
+NS_CC_EXT_END
@@ -0,0 +1,141 @@
+/****************************************************************************
+ Copyright (c) Yassy
+ https://github.com/yassy0413/cocos2dx-3.x-util
+ ****************************************************************************/
+#ifndef __CC_ZIP_DOWNLOAD_QUEUE_H__
+#define __CC_ZIP_DOWNLOAD_QUEUE_H__
+
+#include "cocos2d.h"
+#include "ExtensionMacros.h"
+#include "CCZipDownloader.h"
+#include <set>
+
+NS_CC_EXT_BEGIN
+
+/**
+ * ZipDownloader の同時ダウンロード数と優先度を制御するキュー
+ *
+ * 待機中のジョブは優先度の高いものから、登録された順に開始される。
+ * 同じURLと展開先のジョブは1つにまとめられ、完了すると全てのコールバックが呼ばれる。
+ * ジョブは続きから再開できるようにダウンロードする (streaming を除く) ので、
+ * 一時停止したジョブは再開すると続きからダウンロードされる。
+ * 同時に展開する数は ZipDownloader::setMaxConcurrentExtractions で制限する。
+ * GLスレッドからのみ利用できる。
+ *
+ @code
+ auto id = ZipDownloadQueue::getInstance()->enqueue(url, outdir, ZipDownloadQueue::Priority::Normal, myCallback);
+ ZipDownloadQueue::getInstance()->pause(id);
+ ZipDownloadQueue::getInstance()->resume(id);
+ @endcode
+ */
+class ZipDownloadQueue
+{
+public:
+    CC_DISALLOW_COPY_AND_ASSIGN(ZipDownloadQueue);
+    
+    /**
+     * 優先度 (上にあるものほど優先される)
+     */
+    enum class Priority {
+        High,
+        Normal,
+        Low,
+    };
+    
+    typedef uint32_t JobId;
+    
+    /** Return the shared instance **/
+    static ZipDownloadQueue *getInstance();
+    
+    /** Relase the shared instance **/
+    static void destroyInstance();
+    
+    /**
+     * 同時ダウンロード数の上限を設定 (default: 2)
+     */
+    void setMaxConcurrentDownloads(int32_t count);
+    inline int32_t getMaxConcurrentDownloads() const { return _maxConcurrentDownloads; }
+    
+    /**
+     * urlで指定されたzipファイルをダウンロードし、outdirへ展開するジョブを登録する
+     * 同じURLと展開先のジョブがあれば、コールバックを追加して優先度の高い方に合わせ、そのジョブを返す
+     * options の abortFlag は使われない
+     */
+    JobId enqueue(const std::string& url, const std::string& outdir, Priority priority, const ccZipDownloaderCallback& callback, const ZipDownloader::Options& options = ZipDownloader::Options());
+    
+    /**
+     * ジョブの優先度を変更する
+     */
+    void setPriority(JobId id, Priority priority);
+    
+    /**
+     * ジョブをキャンセルする
+     * コールバックは呼ばれず、途中までダウンロードしたファイルは削除される
+     * まとめられたジョブであれば、全ての登録がキャンセルされる
+     */
+    void cancel(JobId id);
+    
+    /**
+     * ジョブを一時停止する
+     * ダウンロード中であれば中断し、途中までダウンロードしたファイルは残す
+     */
+    void pause(JobId id);
+    
+    /**
+     * 一時停止したジョブを待機中に戻す
+     */
+    void resume(JobId id);
+    
+    bool isPaused(JobId id) const;
+    
+    /**
+     * 待機中のジョブ数 (一時停止したものを除く)
+     */
+    int32_t getNumPendingJobs() const { return static_cast<int32_t>(_pending.size()); }
+    
+    /**
+     * ダウンロードか展開をしているジョブ数
+     */
+    int32_t getNumRunningJobs() const { return _numRunning; }
+
+private:
+    struct Job {
+        std::string url;
+        std::string outdir;
+        ZipDownloader::Options options;
+        std::vector<ccZipDownloaderCallback> callbacks;
+        Priority priority;
+        uint64_t order;
+        bool running;
+        bool paused;
+        bool cancelled;
+        /// 実行中のダウンロードを中断する
+        std::shared_ptr<std::atomic<bool>> abortFlag;
+    };
+    typedef std::pair<std::pair<int32_t, uint64_t>, JobId> PendingKey;
+    
+    ZipDownloadQueue();
+    ~ZipDownloadQueue();
+    
+    static PendingKey makePendingKey(JobId id, const Job& job);
+    static std::string makeJobKey(const std::string& url, const std::string& outdir);
+    void dispatch();
+    void start(JobId id, Job& job);
+    void onFinished(JobId id, const std::shared_ptr<std::atomic<bool>>& abortFlag, bool succeeded);
+    void erase(std::unordered_map<JobId, Job>::iterator it);
+    
+    std::unordered_map<JobId, Job> _jobs;
+    /// URLと展開先からジョブを引く
+    std::unordered_map<std::string, JobId> _jobKeys;
+    std::set<PendingKey> _pending;
+    /// 実行中のダウンロードが、どのインスタンスから開始されたかを見分ける
+    const uint32_t _generation;
+    JobId _nextId;
+    uint64_t _nextOrder;
+    int32_t _numRunning;
+    int32_t _maxConcurrentDownloads;
+};
+
+NS_CC_EXT_END
+
+#endif
@@ -3,73 +3,1501 @@
  https://github.com/yassy0413/cocos2dx-3.x-util
  ****************************************************************************/
 #include "CCZipDownloader.h"
+#include "CCZipUtil.h"
+#include "CCZipFileSystem.h"
 #include "network/HttpClient.h"
+#include "curl/curl.h"
+#include "zlib.h"
+#include <thread>
+#include <set>
+#include <map>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 
 NS_CC_EXT_BEGIN
 
-static void pushToWriteFile(const ccZipDownloaderCallback& callback, const std::string& path, unsigned char* data, ssize_t size){
-    CCLOG("pushToWriteFile: %s", path.c_str());
-    // 別スレッドで実行されるタスク
-    auto task = [path, data, size](){
-        if( data ){
-            FILE* file = fopen(path.c_str(), "wb");
-            fwrite(data, size, 1, file);
+#pragma mark - Stats
+
+typedef std::chrono::steady_clock ZipClock;
+
+static int64_t elapsedNanos(const ZipClock::time_point& since){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(ZipClock::now() - since).count();
+}
+
+/**
+ * スコープを抜けるまでの時間を加算する
+ */
+class ZipStageTimer
+{
+public:
+    explicit ZipStageTimer(std::atomic<int64_t>& nanos)
+    : _nanos(nanos)
+    , _start(ZipClock::now())
+    {}
+    
+    ~ZipStageTimer(){
+        _nanos += elapsedNanos(_start);
+    }
+
+private:
+    std::atomic<int64_t>& _nanos;
+    const ZipClock::time_point _start;
+};
+
+/**
+ * 1回のダウンロードと展開の状態
+ * 複数のスレッドから進捗と各段階の時間を集計し、一定間隔でGLスレッドへ通知する
+ */
+class ZipTransferContext
+{
+public:
+    explicit ZipTransferContext(const ZipDownloader::Options& options)
+    : downloadedBytes(0)
+    , totalBytes(-1)
+    , inflatedBytes(0)
+    , writtenFiles(0)
+    , totalFiles(-1)
+    , networkNanos(0)
+    , inflateNanos(0)
+    , writeNanos(0)
+    , sslCaFile(network::HttpClient::getInstance()->getSSLVerification())
+    , connectTimeout(network::HttpClient::getInstance()->getTimeoutForConnect())
+    , _callback(options.progressCallback)
+    , _intervalNanos(static_cast<int64_t>(options.progressInterval * 1e9))
+    , _abortFlag(options.abortFlag)
+    , _start(ZipClock::now())
+    , _lastReportNanos(0)
+    , _lastDownloadedBytes(0)
+    , _lastInflatedBytes(0)
+    , _lastWrittenFiles(0)
+    {}
+    
+    /**
+     * 中断を要求されているかどうか
+     */
+    bool isAborted() const {
+        return _abortFlag && *_abortFlag;
+    }
+    
+    void addDownloaded(size_t size){
+        downloadedBytes += size;
+        report(false);
+    }
+    
+    void addInflated(size_t size){
+        inflatedBytes += size;
+        report(false);
+    }
+    
+    void addWrittenFile(){
+        ++writtenFiles;
+        report(false);
+    }
+    
+    /**
+     * 前回の通知から interval が過ぎていれば、進捗を通知する
+     * @param force 間隔に関わらず通知する
+     */
+    void report(bool force){
+        if( !_callback ){
+            return;
+        }
+        const int64_t now = elapsedNanos(_start);
+        int64_t last = _lastReportNanos;
+        // 通知するスレッドを1つに絞る
+        if( !force && (now - last < _intervalNanos || !_lastReportNanos.compare_exchange_strong(last, now)) ){
+            return;
+        }
+        if( force ){
+            last = _lastReportNanos.exchange(now);
+        }
+        
+        ZipDownloader::Progress progress;
+        progress.downloadedBytes = downloadedBytes;
+        progress.totalBytes = totalBytes;
+        progress.inflatedBytes = inflatedBytes;
+        progress.writtenFiles = writtenFiles;
+        progress.totalFiles = totalFiles;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            const double seconds = std::max<int64_t>(1, now - last) / 1e9;
+            progress.downloadRate = static_cast<float>((progress.downloadedBytes - _lastDownloadedBytes) / seconds / (1024 * 1024));
+            progress.inflateRate = static_cast<float>((progress.inflatedBytes - _lastInflatedBytes) / seconds / (1024 * 1024));
+            progress.fileRate = static_cast<float>((progress.writtenFiles - _lastWrittenFiles) / seconds);
+            _lastDownloadedBytes = progress.downloadedBytes;
+            _lastInflatedBytes = progress.inflatedBytes;
+            _lastWrittenFiles = progress.writtenFiles;
+        }
+        auto callback = _callback;
+        Director::getInstance()->getScheduler()->performFunctionInCocosThread([callback, progress](){
+            callback(progress);
+        });
+    }
+    
+    ZipDownloader::Result makeResult(bool succeeded) const {
+        ZipDownloader::Result result;
+        result.succeeded = succeeded;
+        result.downloadedBytes = downloadedBytes;
+        result.inflatedBytes = inflatedBytes;
+        result.writtenFiles = writtenFiles;
+        result.networkTime = static_cast<float>(networkNanos / 1e9);
+        result.inflateTime = static_cast<float>(inflateNanos / 1e9);
+        result.writeTime = static_cast<float>(writeNanos / 1e9);
+        result.totalTime = static_cast<float>(elapsedNanos(_start) / 1e9);
+        return result;
+    }
+    
+    std::atomic<int64_t> downloadedBytes;
+    std::atomic<int64_t> totalBytes;
+    std::atomic<int64_t> inflatedBytes;
+    std::atomic<int32_t> writtenFiles;
+    std::atomic<int32_t> totalFiles;
+    std::atomic<int64_t> networkNanos;
+    std::atomic<int64_t> inflateNanos;
+    std::atomic<int64_t> writeNanos;
+    /// HttpClient と同じ通信の設定 (開始したスレッドで取得しておく)
+    const std::string sslCaFile;
+    const long connectTimeout;
+
+private:
+    const ZipDownloader::ProgressCallback _callback;
+    const int64_t _intervalNanos;
+    const std::shared_ptr<std::atomic<bool>> _abortFlag;
+    const ZipClock::time_point _start;
+    std::atomic<int64_t> _lastReportNanos;
+    std::mutex _mutex;
+    int64_t _lastDownloadedBytes;
+    int64_t _lastInflatedBytes;
+    int32_t _lastWrittenFiles;
+};
+
+typedef std::shared_ptr<ZipTransferContext> ZipTransferContextPtr;
+
+/**
+ * 最後の進捗を通知してから、GLスレッドで結果を返す
+ */
+static void postResult(const ZipTransferContextPtr& context, bool succeeded, const ZipDownloader::ResultCallback& resultCallback, const ccZipDownloaderCallback& callback){
+    context->report(true);
+    const ZipDownloader::Result result = context->makeResult(succeeded);
+    Director::getInstance()->getScheduler()->performFunctionInCocosThread([result, resultCallback, callback](){
+        if(resultCallback){ resultCallback(result); }
+        if(callback){ callback(result.succeeded); }
+    });
+}
+
+#pragma mark - Manifest
+
+/**
+ * outdir へ展開したファイルの一覧
+ * 次に展開する時に、CRCとサイズが変わらないファイルを読み飛ばすために使う
+ */
+class ZipManifest
+{
+public:
+    explicit ZipManifest(const std::string& outdir)
+    : _outdir(outdir)
+    , _path(outdir + ".zipmanifest")
+    {
+        load();
+    }
+    
+    /**
+     * 前回と同じ内容のファイルが outdir に残っているかどうか
+     */
+    bool isUnchanged(const std::string& filename, uint32_t crc, uint32_t size) const {
+        const auto it = _entries.find(filename);
+        if( it == _entries.end() || it->second.crc != crc || it->second.size != size ){
+            return false;
+        }
+        // 消されたり書き換えられたファイルは展開し直す
+        return FileUtils::getInstance()->getFileSize(_outdir + filename) == static_cast<long>(size);
+    }
+    
+    void set(const std::string& filename, uint32_t crc, uint32_t size){
+        Entry& entry = _entries[filename];
+        entry.crc = crc;
+        entry.size = size;
+    }
+    
+    void remove(const std::string& filename){
+        _entries.erase(filename);
+    }
+    
+    /**
+     * filenames に含まれないファイルを outdir と一覧から削除する
+     * 削除するのは一覧に記録されているファイルだけで、それ以外のファイルには触れない
+     */
+    void removeStaleFiles(const std::set<std::string>& filenames){
+        for( auto it = _entries.begin(); it != _entries.end(); ){
+            if( filenames.count(it->first) == 0 ){
+                ::remove((_outdir + it->first).c_str());
+                CCLOG("ZipDownloader: removed %s", it->first.c_str());
+                it = _entries.erase(it);
+            }else{
+                ++it;
+            }
+        }
+    }
+    
+    void save() const {
+        std::string text;
+        for( const auto& it : _entries ){
+            text += StringUtils::format("%08x\t%u\t", it.second.crc, it.second.size);
+            text += it.first;
+            text.push_back('\n');
+        }
+        const std::string tmpPath = _path + ".tmp";
+        FILE* file = fopen(tmpPath.c_str(), "wb");
+        if( file ){
+            fwrite(text.data(), text.size(), 1, file);
             fclose(file);
-            CCLOG("endOfWriteFile: %s", path.c_str());
-            
-            // zipfile->getFileData で確保されたメモリを開放する
-            free(data);
+            rename(tmpPath.c_str(), _path.c_str());
         }
+    }
+    
+    /**
+     * 一覧が信用できなくなったら、次は全て展開し直すように削除する
+     */
+    void discard(){
+        _entries.clear();
+        ::remove(_path.c_str());
+    }
+
+private:
+    struct Entry {
+        uint32_t crc;
+        uint32_t size;
     };
-    // 最後にUIスレッドで実行されるタスク
-    auto finished = [callback](void*){
-        if(callback){ callback(true); }
-    };
-    // 非同期タスクの開始 (TASK_IOのスレッドキューへ積まれる)
-    AsyncTaskPool::getInstance()->enqueue(AsyncTaskPool::TaskType::TASK_IO, finished, nullptr, task);
+    
+    void load(){
+        // 1行に [CRC] [サイズ] [ファイル名] をタブ区切りで記録している
+        FILE* file = fopen(_path.c_str(), "rb");
+        if( !file ){
+            return;
+        }
+        std::string line;
+        for( int c = fgetc(file); c != EOF; c = fgetc(file) ){
+            if( c != '\n' ){
+                line.push_back(static_cast<char>(c));
+                continue;
+            }
+            const auto sep1 = line.find('\t');
+            const auto sep2 = (sep1 == std::string::npos)? sep1 : line.find('\t', sep1+1);
+            if( sep2 != std::string::npos ){
+                set(line.substr(sep2+1), static_cast<uint32_t>(strtoul(line.c_str(), nullptr, 16)), static_cast<uint32_t>(strtoul(line.c_str() + sep1 + 1, nullptr, 10)));
+            }
+            line.clear();
+        }
+        fclose(file);
+    }
+    
+    const std::string _outdir;
+    const std::string _path;
+    std::map<std::string, Entry> _entries;
+};
+
+#pragma mark - Extract
+
+static bool extractFile(const unsigned char* data, size_t size, const ziputil::Entry& entry, const std::string& path, ZipTransferContext& context){
+    const auto start = ZipClock::now();
+    std::atomic<int64_t> writeNanos(0);
+    FILE* file;
+    {
+        ZipStageTimer timer(writeNanos);
+        file = fopen(path.c_str(), "wb");
+    }
+    if( !file ){
+        CCLOG("ZipDownloader: failed to open %s", path.c_str());
+        return false;
+    }
+    const bool succeeded = ziputil::extract(data, size, entry, [file, &context, &writeNanos](const unsigned char* data, size_t size){
+        context.addInflated(size);
+        ZipStageTimer timer(writeNanos);
+        return fwrite(data, size, 1, file) == 1;
+    });
+    {
+        ZipStageTimer timer(writeNanos);
+        fclose(file);
+    }
+    // 書き込みの合間に展開している
+    context.writeNanos += writeNanos;
+    context.inflateNanos += elapsedNanos(start) - writeNanos;
+    if( !succeeded ){
+        CCLOG("ZipDownloader: failed to extract %s", path.c_str());
+        ::remove(path.c_str());
+        return false;
+    }
+    CCLOG("endOfWriteFile: %s", path.c_str());
+    context.addWrittenFile();
+    return true;
 }
 
-static void pushToUnzip(const ccZipDownloaderCallback& callback, const std::string& outdir, network::HttpResponse* response){
-    // 別スレッドで実行されるタスク
-    auto task = [callback, outdir, response](){
-        
-        // zipに含まれるファイル情報リストを取得
-        ZipFile* zipfile = ZipFile::createWithBuffer(response->getResponseData()->data(),
-                                                     response->getResponseData()->size());
-        for( std::string filename = zipfile->getFirstFilename(); !filename.empty(); filename = zipfile->getNextFilename() ){
-            if( *filename.rbegin() == '/' ){
-                
-                // It's a directory.
-                FileUtils::getInstance()->createDirectory( outdir + filename );
-                
+/**
+ * 同時に展開するzipファイルの数を制限する
+ */
+class ZipExtractionSlots
+{
+public:
+    ZipExtractionSlots()
+    : _limit(0)
+    , _running(0)
+    {}
+    
+    void setLimit(int32_t limit){
+        std::lock_guard<std::mutex> lock(_mutex);
+        _limit = limit;
+        _condition.notify_all();
+    }
+    
+    int32_t getLimit() const {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _limit;
+    }
+    
+    /**
+     * 空きを待って確保する
+     * @return 待っている間に中断されたら false
+     */
+    bool acquire(const ZipTransferContext& context){
+        std::unique_lock<std::mutex> lock(_mutex);
+        // 中断は通知されないので、一定間隔で確かめる
+        while( _limit > 0 && _running >= _limit ){
+            if( context.isAborted() ){
+                return false;
+            }
+            _condition.wait_for(lock, std::chrono::milliseconds(100));
+        }
+        ++_running;
+        return true;
+    }
+    
+    void release(){
+        std::lock_guard<std::mutex> lock(_mutex);
+        --_running;
+        _condition.notify_one();
+    }
+
+private:
+    mutable std::mutex _mutex;
+    std::condition_variable _condition;
+    int32_t _limit;
+    int32_t _running;
+};
+
+static ZipExtractionSlots s_extractionSlots;
+
+/**
+ * 中央ディレクトリを読み込み、各ファイルを複数のスレッドで展開する
+ * 各スレッドは展開しながら直接ファイルへ書き込むので、展開したデータ全体をメモリに持つことはない
+ */
+static bool extractArchive(const unsigned char* data, size_t size, const std::string& outdir, int32_t numThreads, bool incremental, bool removeStaleFiles, ZipTransferContext& context){
+    std::vector<ziputil::Entry> entries;
+    if( !ziputil::readCentralDirectory(data, size, entries) ){
+        CCLOG("ZipDownloader: invalid zip file");
+        return false;
+    }
+    
+    // ディレクトリはスレッド間で取り合わないように、先にまとめて作成しておく
+    ZipManifest manifest(outdir);
+    std::set<std::string> directories;
+    directories.insert(outdir);
+    std::set<std::string> filenames;
+    std::vector<const ziputil::Entry*> files;
+    for( const auto& entry : entries ){
+        if( !ziputil::isSafeFilename(entry.filename) ){
+            CCLOG("ZipDownloader: unsafe filename %s", entry.filename.c_str());
+            return false;
+        }
+        const std::string path = outdir + entry.filename;
+        directories.insert(path.substr(0, path.rfind('/') + 1));
+        if( entry.isDirectory() ){
+            continue;
+        }
+        filenames.insert(entry.filename);
+        // 中央ディレクトリのCRCとサイズが前回と同じファイルは展開しない
+        if( incremental && manifest.isUnchanged(entry.filename, entry.crc32, entry.uncompressedSize) ){
+            continue;
+        }
+        files.push_back(&entry);
+    }
+    for( const auto& directory : directories ){
+        FileUtils::getInstance()->createDirectory(directory);
+    }
+    
+    context.totalFiles = static_cast<int32_t>(files.size());
+    if( !s_extractionSlots.acquire(context) ){
+        return false;
+    }
+    
+    // 大きなファイルから順に割り当てて、スレッド毎の処理量を揃える
+    std::sort(files.begin(), files.end(), [](const ziputil::Entry* a, const ziputil::Entry* b){
+        return a->compressedSize > b->compressedSize;
+    });
+    
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    std::vector<char> extracted(files.size(), 0);
+    auto worker = [&](){
+        for( size_t index = next++; index < files.size() && !failed; index = next++ ){
+            if( context.isAborted() ){
+                failed = true;
+                break;
+            }
+            if( extractFile(data, size, *files[index], outdir + files[index]->filename, context) ){
+                extracted[index] = 1;
             }else{
-                
-                // It's a file.
-                ssize_t filesize;
-                unsigned char* filedata = zipfile->getFileData( filename, &filesize );
-                // ファイルデータが取得できたので、書き込みを行うスレッドへ送る
-                pushToWriteFile(nullptr, outdir + filename, filedata, filesize);
-                
+                failed = true;
             }
         }
-        delete zipfile;
-        
-        // 終了判定用に空データを送る
-        pushToWriteFile(callback, "", nullptr, 0);
-    };
-    // 最後にUIスレッドで実行されるタスク
-    auto finished = [response](void*){
-        response->release();
     };
+    std::vector<std::thread> threads;
+    for( int32_t lp = 1; lp < std::min<int32_t>(numThreads, static_cast<int32_t>(files.size())); ++lp ){
+        threads.emplace_back(worker);
+    }
+    worker();
+    for( auto& thread : threads ){
+        thread.join();
+    }
+    s_extractionSlots.release();
+    
+    // 途中で失敗しても、展開できたファイルは記録しておく
+    for( size_t index = 0; index < files.size(); ++index ){
+        const ziputil::Entry& entry = *files[index];
+        if( extracted[index] ){
+            manifest.set(entry.filename, entry.crc32, entry.uncompressedSize);
+        }else{
+            manifest.remove(entry.filename);
+        }
+    }
+    if( !failed && removeStaleFiles ){
+        manifest.removeStaleFiles(filenames);
+    }
+    manifest.save();
+    return !failed;
+}
+
+static void pushToUnzip(const ccZipDownloaderCallback& callback, const std::string& outdir, int32_t numThreads, const ZipDownloader::Options& options, const ZipTransferContextPtr& context, network::HttpResponse* response){
     // unzipタスク実行中に破棄されないよう保護する
     response->retain();
-    // 非同期タスクの開始 (TASK_OTHERのスレッドキューへ積まれる)
-    AsyncTaskPool::getInstance()->enqueue(AsyncTaskPool::TaskType::TASK_OTHER, finished, nullptr, task);
+    // 展開の枠が空くまで待つことがあるので、AsyncTaskPool (TASK_OTHER は LazySprite のデコードと共有している) を使わずに専用のスレッドで展開する
+    auto resultCallback = options.resultCallback;
+    const bool incremental = options.incremental;
+    const bool removeStaleFiles = options.removeStaleFiles;
+    std::thread([callback, resultCallback, outdir, numThreads, incremental, removeStaleFiles, context, response](){
+        const std::vector<char>* data = response->getResponseData();
+        const bool succeeded = extractArchive(reinterpret_cast<const unsigned char*>(data->data()), data->size(), outdir, numThreads, incremental, removeStaleFiles, *context);
+        context->report(true);
+        // 最後にUIスレッドで実行されるタスク
+        Director::getInstance()->getScheduler()->performFunctionInCocosThread([callback, resultCallback, context, response, succeeded](){
+            response->release();
+            if(resultCallback){ resultCallback(context->makeResult(succeeded)); }
+            if(callback){ callback(succeeded); }
+        });
+    }).detach();
+}
+
+#pragma mark - Streaming
+
+/**
+ * 展開したデータをファイルへ書き込むスレッド
+ * 書き込み待ちのデータ量が上限を超えたら、空きができるまで展開する側を待たせる
+ * 受信する側は isCongested で待たされる前に受信を止める
+ */
+class ZipWriteQueue
+{
+public:
+    ZipWriteQueue(size_t maxPendingBytes, ZipTransferContext& context)
+    : _context(context)
+    , _maxPendingBytes(maxPendingBytes)
+    , _pendingBytes(0)
+    , _finishing(false)
+    , _failed(false)
+    , _thread(&ZipWriteQueue::run, this)
+    {}
+    
+    ~ZipWriteQueue(){
+        finish();
+    }
+    
+    /**
+     * 以降の write の書き込み先を開く
+     */
+    bool open(const std::string& path){
+        Command command;
+        command.type = Command::Type::Open;
+        command.path = path;
+        return push(std::move(command));
+    }
+    
+    /**
+     * データをコピーして書き込みを待つ
+     * @return 書き込みに失敗していれば false
+     */
+    bool write(const unsigned char* data, size_t size){
+        Command command;
+        command.type = Command::Type::Write;
+        command.data.assign(data, data + size);
+        return push(std::move(command));
+    }
+    
+    bool close(){
+        Command command;
+        command.type = Command::Type::Close;
+        return push(std::move(command));
+    }
+    
+    /**
+     * 書き込み待ちのデータ量が上限の半分を超えているかどうか
+     * 残りの半分は、受信済みの1回分のデータを展開した分として空けておく
+     */
+    bool isCongested(){
+        std::lock_guard<std::mutex> lock(_mutex);
+        return !_failed && _pendingBytes * 2 > _maxPendingBytes;
+    }
+    
+    /**
+     * 全ての書き込みが終わるのを待つ
+     * @return 全て書き込めていれば true
+     */
+    bool finish(){
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _finishing = true;
+        }
+        _pushed.notify_one();
+        if( _thread.joinable() ){
+            _thread.join();
+        }
+        return !_failed;
+    }
+
+private:
+    struct Command {
+        enum class Type {
+            Open,
+            Write,
+            Close,
+        };
+        Type type;
+        std::string path;
+        std::vector<unsigned char> data;
+    };
+    
+    bool push(Command&& command){
+        const size_t size = command.data.size();
+        std::unique_lock<std::mutex> lock(_mutex);
+        // 1つで上限を超えるデータでも、待ちが無くなれば受け付ける
+        _popped.wait(lock, [this, size](){
+            return _failed || _pendingBytes == 0 || _pendingBytes + size <= _maxPendingBytes;
+        });
+        if( _failed ){
+            return false;
+        }
+        _pendingBytes += size;
+        _commands.push_back(std::move(command));
+        lock.unlock();
+        _pushed.notify_one();
+        return true;
+    }
+    
+    void run(){
+        FILE* file = nullptr;
+        for(;;){
+            Command command;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _pushed.wait(lock, [this](){ return _finishing || !_commands.empty(); });
+                if( _commands.empty() ){
+                    break;
+                }
+                command = std::move(_commands.front());
+                _commands.pop_front();
+            }
+            
+            bool succeeded = true;
+            {
+                ZipStageTimer timer(_context.writeNanos);
+                switch( command.type ){
+                    case Command::Type::Open:
+                        file = fopen(command.path.c_str(), "wb");
+                        if( !file ){
+                            CCLOG("ZipDownloader: failed to open %s", command.path.c_str());
+                            succeeded = false;
+                        }
+                        break;
+                    case Command::Type::Write:
+                        succeeded = file && fwrite(command.data.data(), command.data.size(), 1, file) == 1;
+                        break;
+                    case Command::Type::Close:
+                        if( file ){
+                            fclose(file);
+                            file = nullptr;
+                        }
+                        break;
+                }
+            }
+            
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _pendingBytes -= command.data.size();
+                _failed = _failed || !succeeded;
+            }
+            _popped.notify_one();
+        }
+        if( file ){
+            fclose(file);
+        }
+    }
+    
+    ZipTransferContext& _context;
+    const size_t _maxPendingBytes;
+    size_t _pendingBytes;
+    bool _finishing;
+    std::atomic<bool> _failed;
+    std::deque<Command> _commands;
+    std::mutex _mutex;
+    std::condition_variable _pushed;
+    std::condition_variable _popped;
+    std::thread _thread;
+};
+
+/**
+ * 届いた順にデータを受け取り、ローカルファイルヘッダを辿りながら展開する
+ * 保持するのはヘッダの途中までのデータと、展開用のバッファと、書き込み待ちのデータだけになる
+ */
+class ZipStreamExtractor
+{
+public:
+    ZipStreamExtractor(const std::string& outdir, size_t maxPendingWriteBytes, bool incremental, bool removeStaleFiles, ZipTransferContext& context)
+    : _context(context)
+    , _outdir(outdir)
+    , _incremental(incremental)
+    , _removeStaleFiles(removeStaleFiles)
+    , _manifest(outdir)
+    , _state(State::Header)
+    , _remaining(0)
+    , _crc(0)
+    , _written(0)
+    , _fileOpened(false)
+    , _waitNanos(0)
+    , _writer(maxPendingWriteBytes, context)
+    {}
+    
+    /**
+     * 受信したデータを渡す
+     * @return 壊れたデータであれば false
+     */
+    bool feed(const unsigned char* data, size_t size){
+        // 書き込みを待っていた時間を除いて、展開にかかった時間とする
+        const auto start = ZipClock::now();
+        _waitNanos = 0;
+        while( size > 0 && _state != State::Error ){
+            size_t consumed = 0;
+            switch( _state ){
+                case State::Header: consumed = feedHeader(data, size); break;
+                case State::Data: consumed = feedData(data, size); break;
+                case State::Skip: consumed = feedSkip(data, size); break;
+                case State::Descriptor: consumed = feedDescriptor(data, size); break;
+                // 中央ディレクトリ以降は読み飛ばす
+                case State::Done: consumed = size; break;
+                case State::Error: break;
+            }
+            data += consumed;
+            size -= consumed;
+        }
+        _context.inflateNanos += elapsedNanos(start) - _waitNanos;
+        return _state != State::Error;
+    }
+    
+    /**
+     * 書き込みが追いついていなければ true
+     */
+    bool isWriteCongested(){
+        return _writer.isCongested();
+    }
+    
+    /**
+     * 全てのデータを渡し終えたら呼ぶ
+     * @return 全てのファイルを展開できていれば true
+     */
+    bool finish(){
+        closeFile();
+        if( !_writer.finish() ){
+            // どのファイルまで書き込めたか分からない
+            _manifest.discard();
+            return false;
+        }
+        if( _state == State::Done && _removeStaleFiles ){
+            _manifest.removeStaleFiles(_filenames);
+        }
+        _manifest.save();
+        return _state == State::Done;
+    }
+
+private:
+    enum class State {
+        Header,
+        Data,
+        Skip,
+        Descriptor,
+        Done,
+        Error,
+    };
+    
+    /// ヘッダを読み込めるだけのデータを貯めてから解釈する
+    size_t feedHeader(const unsigned char* data, size_t size){
+        size_t consumed = 0;
+        for(;;){
+            size_t required = 4;
+            if( _buffer.size() >= 4 ){
+                const uint32_t signature = ziputil::readUInt32(_buffer.data());
+                if( signature == ziputil::CENTRAL_DIRECTORY_SIGNATURE || signature == ziputil::END_OF_CENTRAL_DIRECTORY_SIGNATURE ){
+                    // 全てのファイルを読み終えた
+                    _state = State::Done;
+                    _buffer.clear();
+                    return consumed;
+                }
+                if( signature != ziputil::LOCAL_FILE_HEADER_SIGNATURE ){
+                    CCLOG("ZipDownloader: unexpected signature %08x", signature);
+                    _state = State::Error;
+                    return consumed;
+                }
+                required = ziputil::LOCAL_FILE_HEADER_SIZE;
+                if( _buffer.size() >= required ){
+                    required += ziputil::readUInt16(_buffer.data() + 26) + ziputil::readUInt16(_buffer.data() + 28);
+                }
+            }
+            if( _buffer.size() >= ziputil::LOCAL_FILE_HEADER_SIZE && _buffer.size() == required ){
+                ziputil::readLocalFileHeader(_buffer.data(), _buffer.size(), _header);
+                _buffer.clear();
+                if( !beginEntry() ){
+                    _state = State::Error;
+                }
+                return consumed;
+            }
+            if( consumed == size ){
+                return consumed;
+            }
+            const size_t length = std::min(size - consumed, required - _buffer.size());
+            _buffer.insert(_buffer.end(), data + consumed, data + consumed + length);
+            consumed += length;
+        }
+    }
+    
+    size_t feedData(const unsigned char* data, size_t size){
+        const bool descriptor = _header.hasDataDescriptor();
+        const size_t available = descriptor? size : static_cast<size_t>(std::min<uint64_t>(size, _remaining));
+        size_t consumed = 0;
+        const bool succeeded = _decompressor->update(data, available, consumed, [this](const unsigned char* data, size_t size){
+            return writeFile(data, size);
+        });
+        if( !succeeded ){
+            CCLOG("ZipDownloader: failed to decompress %s", _header.filename.c_str());
+            _state = State::Error;
+            return consumed;
+        }
+        if( !descriptor ){
+            _remaining -= consumed;
+            if( _decompressor->isSelfTerminating() && _decompressor->isFinished() != (_remaining == 0) ){
+                CCLOG("ZipDownloader: size mismatch %s", _header.filename.c_str());
+                _state = State::Error;
+            }else if( _remaining == 0 ){
+                _state = endEntry(_header.crc32, _header.uncompressedSize)? State::Header : State::Error;
+            }
+        }else if( _decompressor->isFinished() ){
+            _state = State::Descriptor;
+        }
+        return consumed;
+    }
+    
+    /// 前回と同じファイルの圧縮されたデータを読み飛ばす
+    size_t feedSkip(const unsigned char* data, size_t size){
+        const size_t consumed = static_cast<size_t>(std::min<uint64_t>(size, _remaining));
+        _remaining -= consumed;
+        if( _remaining == 0 ){
+            _state = State::Header;
+        }
+        return consumed;
+    }
+    
+    /// データディスクリプタは署名が省略されていることがある
+    size_t feedDescriptor(const unsigned char* data, size_t size){
+        size_t required = 12;
+        if( _buffer.size() >= 4 && ziputil::readUInt32(_buffer.data()) == ziputil::DATA_DESCRIPTOR_SIGNATURE ){
+            required = 16;
+        }
+        const size_t consumed = std::min(size, required - _buffer.size());
+        _buffer.insert(_buffer.end(), data, data + consumed);
+        if( _buffer.size() == 12 && ziputil::readUInt32(_buffer.data()) == ziputil::DATA_DESCRIPTOR_SIGNATURE ){
+            return consumed;
+        }
+        if( _buffer.size() == required ){
+            const unsigned char* p = _buffer.data() + (required - 12);
+            const uint32_t crc = ziputil::readUInt32(p);
+            const uint32_t uncompressedSize = ziputil::readUInt32(p + 8);
+            _buffer.clear();
+            _state = endEntry(crc, uncompressedSize)? State::Header : State::Error;
+        }
+        return consumed;
+    }
+    
+    bool beginEntry(){
+        const std::string& filename = _header.filename;
+        if( !ziputil::isSafeFilename(filename) ){
+            CCLOG("ZipDownloader: unsafe filename %s", filename.c_str());
+            return false;
+        }
+        _decompressor.reset(new (std::nothrow) ziputil::Decompressor(_header.method));
+        if( !_decompressor->isSupported() ){
+            CCLOG("ZipDownloader: unsupported method %d %s", _header.method, filename.c_str());
+            return false;
+        }
+        // 無圧縮のデータは、サイズが分からなければ終わりを判断できない
+        if( _header.hasDataDescriptor() && !_decompressor->isSelfTerminating() ){
+            CCLOG("ZipDownloader: stored entry without size %s", filename.c_str());
+            return false;
+        }
+        _remaining = _header.compressedSize;
+        _crc = crc32(0, Z_NULL, 0);
+        _written = 0;
+        
+        const std::string path = _outdir + filename;
+        if( *filename.rbegin() == '/' ){
+            // It's a directory.
+            FileUtils::getInstance()->createDirectory(path);
+        }else{
+            _filenames.insert(filename);
+            // CRCとサイズがヘッダにあり、前回と同じであれば展開しない
+            // データディスクリプタを使うzipファイルでは、展開し終えるまでCRCが分からない
+            if( _incremental && !_header.hasDataDescriptor() && _manifest.isUnchanged(filename, _header.crc32, _header.uncompressedSize) ){
+                _state = (_remaining > 0)? State::Skip : State::Header;
+                return true;
+            }
+            _manifest.remove(filename);
+            // It's a file.
+            const auto slash = path.rfind('/');
+            if( slash != std::string::npos ){
+                FileUtils::getInstance()->createDirectory(path.substr(0, slash + 1));
+            }
+            _fileOpened = _writer.open(path);
+            if( !_fileOpened ){
+                return false;
+            }
+        }
+        _state = State::Data;
+        
+        // 空のファイルはデータを待たずに終わる
+        if( !_header.hasDataDescriptor() && _remaining == 0 && !_decompressor->isSelfTerminating() ){
+            _state = endEntry(_header.crc32, _header.uncompressedSize)? State::Header : State::Error;
+        }
+        return _state != State::Error;
+    }
+    
+    bool endEntry(uint32_t crc, uint32_t uncompressedSize){
+        closeFile();
+        if( _crc != crc || static_cast<uint32_t>(_written) != uncompressedSize ){
+            CCLOG("ZipDownloader: crc mismatch %s", _header.filename.c_str());
+            return false;
+        }
+        if( *_header.filename.rbegin() != '/' ){
+            _manifest.set(_header.filename, crc, uncompressedSize);
+            _context.addWrittenFile();
+        }
+        CCLOG("endOfWriteFile: %s", (_outdir + _header.filename).c_str());
+        return true;
+    }
+    
+    bool writeFile(const unsigned char* data, size_t size){
+        _crc = crc32(_crc, data, static_cast<uInt>(size));
+        _written += size;
+        _context.addInflated(size);
+        // 書き込みが追いつかなければ、ここで待たされる
+        ZipStageTimer timer(_waitNanos);
+        return _fileOpened && _writer.write(data, size);
+    }
+    
+    void closeFile(){
+        if( _fileOpened ){
+            _writer.close();
+            _fileOpened = false;
+        }
+    }
+    
+    ZipTransferContext& _context;
+    const std::string _outdir;
+    const bool _incremental;
+    const bool _removeStaleFiles;
+    ZipManifest _manifest;
+    std::set<std::string> _filenames;
+    State _state;
+    std::vector<unsigned char> _buffer;
+    ziputil::LocalFileHeader _header;
+    std::unique_ptr<ziputil::Decompressor> _decompressor;
+    uint64_t _remaining;
+    uLong _crc;
+    uint64_t _written;
+    bool _fileOpened;
+    std::atomic<int64_t> _waitNanos;
+    ZipWriteQueue _writer;
+};
+
+static int onTransferInfo(void* userdata, curl_off_t, curl_off_t, curl_off_t, curl_off_t){
+    // 0 以外を返すと、受信を待っている間でも中断される
+    return static_cast<ZipTransferContext*>(userdata)->isAborted()? 1 : 0;
+}
+
+static void setCommonOptions(CURL* curl, const std::string& url, ZipTransferContext& context){
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, context.connectTimeout);
+    // HttpClient と同じく、CAファイルが設定されていなければ証明書を検証しない
+    // プロキシは環境変数 (http_proxy など) が使われる
+    if( context.sslCaFile.empty() ){
+        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+    }else{
+        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
+        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 2L);
+        curl_easy_setopt(curl, CURLOPT_CAINFO, context.sslCaFile.c_str());
+    }
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 30L);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, onTransferInfo);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &context);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+}
+
+static int64_t getContentLength(CURL* curl){
+#if LIBCURL_VERSION_NUM >= 0x073700
+    curl_off_t length = -1;
+    const CURLINFO info = CURLINFO_CONTENT_LENGTH_DOWNLOAD_T;
+#else
+    double length = -1;
+    const CURLINFO info = CURLINFO_CONTENT_LENGTH_DOWNLOAD;
+#endif
+    if( curl_easy_getinfo(curl, info, &length) != CURLE_OK || length < 0 ){
+        return -1;
+    }
+    return static_cast<int64_t>(length);
+}
+
+struct StreamingTransfer {
+    CURL* curl;
+    ZipStreamExtractor* extractor;
+    ZipTransferContext* context;
+    /// 展開と、書き込みを待っていた時間
+    int64_t feedNanos;
+    /// 書き込みを待つために受信を止めているかどうか
+    bool paused;
+    ZipClock::time_point pausedAt;
+};
+
+static int onStreamingTransferInfo(void* userdata, curl_off_t, curl_off_t, curl_off_t, curl_off_t){
+    auto transfer = static_cast<StreamingTransfer*>(userdata);
+    if( transfer->context->isAborted() ){
+        return 1;
+    }
+    // 止めている間も呼ばれるので、書き込みが追いついたら受信を再開する
+    if( transfer->paused && !transfer->extractor->isWriteCongested() ){
+        transfer->paused = false;
+        transfer->feedNanos += elapsedNanos(transfer->pausedAt);
+        curl_easy_pause(transfer->curl, CURLPAUSE_CONT);
+    }
+    return 0;
+}
+
+static size_t onStreamingWrite(char* ptr, size_t size, size_t nmemb, void* userdata){
+    const size_t length = size * nmemb;
+    auto transfer = static_cast<StreamingTransfer*>(userdata);
+    if( transfer->context->isAborted() ){
+        return 0;
+    }
+    // 書き込みが追いつかなければ、コールバックの中で待たずに受信を止める
+    // 止めている間は LOW_SPEED_TIME の対象にならず、再開すると同じデータがもう一度渡される
+    if( transfer->extractor->isWriteCongested() ){
+        transfer->paused = true;
+        transfer->pausedAt = ZipClock::now();
+        return CURL_WRITEFUNC_PAUSE;
+    }
+    if( transfer->context->totalBytes < 0 ){
+        transfer->context->totalBytes = getContentLength(transfer->curl);
+    }
+    transfer->context->addDownloaded(length);
+    const auto start = ZipClock::now();
+    const bool succeeded = transfer->extractor->feed(reinterpret_cast<const unsigned char*>(ptr), length);
+    transfer->feedNanos += elapsedNanos(start);
+    // 0 以外の異なる値を返すと、ダウンロードが中断される
+    return succeeded? length : 0;
+}
+
+static void startStreaming(const std::string& url, const std::string& outdir, const ZipDownloader::Options& options, const ZipTransferContextPtr& context, const ccZipDownloaderCallback& callback){
+    // ダウンロードと展開を同じスレッドで行い、受信したデータから順に展開する
+    // 書き込みは別のスレッドで行い、書き込みが追いつかなければ受信を一時停止する
+    std::thread([url, outdir, options, context, callback](){
+        FileUtils::getInstance()->createDirectory(outdir);
+        ZipStreamExtractor extractor(outdir, options.maxPendingWriteBytes, options.incremental, options.removeStaleFiles, *context);
+        bool succeeded = false;
+        if( CURL* curl = curl_easy_init() ){
+            setCommonOptions(curl, url, *context);
+            StreamingTransfer transfer = { curl, &extractor, context.get(), 0, false, ZipClock::time_point() };
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, onStreamingWrite);
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &transfer);
+            curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, onStreamingTransferInfo);
+            curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &transfer);
+            const auto start = ZipClock::now();
+            const CURLcode code = curl_easy_perform(curl);
+            context->networkNanos += elapsedNanos(start) - transfer.feedNanos;
+            if( code != CURLE_OK && !context->isAborted() ){
+                CCLOG("ZipDownloader: %s %s", curl_easy_strerror(code), url.c_str());
+            }
+            succeeded = extractor.finish() && code == CURLE_OK;
+            curl_easy_cleanup(curl);
+        }
+        postResult(context, succeeded, options.resultCallback, callback);
+    }).detach();
+}
+
+#pragma mark - Resumable
+
+/// 範囲を分けてダウンロードする時の、1つの範囲の最小サイズ
+static const int64_t MIN_RANGE_SIZE = 1024 * 1024;
+
+/// 受信中に途中経過を記録する間隔 (秒)
+static const int64_t STATE_SAVE_INTERVAL_SECONDS = 1;
+
+/**
+ * 再開できるダウンロードの途中経過
+ * 受信したデータは outdir の .zipdownload へ、各範囲の受信済みのサイズは .zipdownload.info へ記録する
+ */
+struct ZipDownloadState {
+    struct Range {
+        int64_t begin;
+        /// 終わりの位置 (含まない)。サイズが分からなければ -1
+        int64_t end;
+        int64_t received;
+        
+        bool isComplete() const { return end >= 0 && begin + received == end; }
+    };
+    
+    std::string url;
+    /// ETag、無ければ Last-Modified (どちらも無ければ空)
+    std::string validator;
+    /// 全体のサイズ (分からなければ -1)
+    int64_t size;
+    bool acceptRanges;
+    std::vector<Range> ranges;
+    
+    ZipDownloadState()
+    : size(-1)
+    , acceptRanges(false)
+    {}
+    
+    /**
+     * 途中から再開してよいかどうか
+     * ETag か サイズ で、同じ内容であることを確かめられなければ再開しない
+     */
+    bool canResume(const ZipDownloadState& remote) const {
+        return isResumable() && url == remote.url && validator == remote.validator && size == remote.size;
+    }
+    
+    /**
+     * 途中経過を残しておく価値があるかどうか (次回、同じ内容であることを確かめられる)
+     */
+    bool isResumable() const {
+        return !ranges.empty() && (!validator.empty() || size >= 0);
+    }
+    
+    bool isComplete() const {
+        for( const auto& range : ranges ){
+            if( !range.isComplete() ){
+                return false;
+            }
+        }
+        return !ranges.empty();
+    }
+    
+    /**
+     * 全体を numRanges に分けて、始めからダウンロードする
+     */
+    void reset(int32_t numRanges){
+        ranges.clear();
+        if( size < 0 || !acceptRanges ){
+            numRanges = 1;
+        }else{
+            numRanges = static_cast<int32_t>(std::max<int64_t>(1, std::min<int64_t>(numRanges, size / MIN_RANGE_SIZE)));
+        }
+        for( int32_t lp = 0; lp < numRanges; ++lp ){
+            Range range;
+            range.begin = (size < 0)? 0 : size * lp / numRanges;
+            range.end = (size < 0)? -1 : size * (lp + 1) / numRanges;
+            range.received = 0;
+            ranges.push_back(range);
+        }
+    }
+    
+    // [URL] [検証用の値] [サイズ] の後に、1行に [開始位置] [終了位置] [受信済みのサイズ] をタブ区切りで記録している
+    bool load(const std::string& path){
+        FILE* file = fopen(path.c_str(), "rb");
+        if( !file ){
+            return false;
+        }
+        std::vector<std::string> lines(1);
+        for( int c = fgetc(file); c != EOF; c = fgetc(file) ){
+            if( c == '\n' ){
+                lines.emplace_back();
+            }else{
+                lines.back().push_back(static_cast<char>(c));
+            }
+        }
+        fclose(file);
+        if( lines.size() < 3 ){
+            return false;
+        }
+        url = lines[0];
+        validator = lines[1];
+        size = strtoll(lines[2].c_str(), nullptr, 10);
+        ranges.clear();
+        for( size_t lp = 3; lp < lines.size(); ++lp ){
+            const std::string& line = lines[lp];
+            const auto sep1 = line.find('\t');
+            const auto sep2 = (sep1 == std::string::npos)? sep1 : line.find('\t', sep1+1);
+            if( sep2 == std::string::npos ){
+                continue;
+            }
+            Range range;
+            range.begin = strtoll(line.c_str(), nullptr, 10);
+            range.end = strtoll(line.c_str() + sep1 + 1, nullptr, 10);
+            range.received = strtoll(line.c_str() + sep2 + 1, nullptr, 10);
+            ranges.push_back(range);
+        }
+        return true;
+    }
+    
+    void save(const std::string& path) const {
+        std::string text = url + "\n" + validator + "\n" + StringUtils::format("%lld\n", static_cast<long long>(size));
+        for( const auto& range : ranges ){
+            text += StringUtils::format("%lld\t%lld\t%lld\n", static_cast<long long>(range.begin), static_cast<long long>(range.end), static_cast<long long>(range.received));
+        }
+        const std::string tmpPath = path + ".tmp";
+        FILE* file = fopen(tmpPath.c_str(), "wb");
+        if( file ){
+            fwrite(text.data(), text.size(), 1, file);
+            fclose(file);
+            rename(tmpPath.c_str(), path.c_str());
+        }
+    }
+};
+
+static size_t onHeader(char* ptr, size_t size, size_t nmemb, void* userdata){
+    const size_t length = size * nmemb;
+    auto state = static_cast<ZipDownloadState*>(userdata);
+    std::string line(ptr, length);
+    while( !line.empty() && (line.back() == '\r' || line.back() == '\n') ){
+        line.pop_back();
+    }
+    if( line.compare(0, 5, "HTTP/") == 0 ){
+        // リダイレクトされたら、最後の応答のヘッダだけを使う
+        state->validator.clear();
+        state->acceptRanges = false;
+        return length;
+    }
+    const auto colon = line.find(':');
+    if( colon == std::string::npos ){
+        return length;
+    }
+    std::string name = line.substr(0, colon);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    const auto begin = line.find_first_not_of(' ', colon + 1);
+    const std::string value = (begin == std::string::npos)? "" : line.substr(begin);
+    if( name == "etag" ){
+        state->validator = value;
+    }else if( name == "last-modified" && state->validator.empty() ){
+        state->validator = value;
+    }else if( name == "accept-ranges" ){
+        state->acceptRanges = (value == "bytes");
+    }
+    return length;
+}
+
+/**
+ * HEAD で、サイズと検証用の値と範囲指定に対応しているかを調べる
+ * @return 問い合わせに失敗したら false (remote はサイズも検証用の値も分からない状態になる)
+ */
+static bool fetchRemoteState(const std::string& url, ZipTransferContext& context, ZipDownloadState& remote){
+    remote = ZipDownloadState();
+    remote.url = url;
+    bool fetched = false;
+    if( CURL* curl = curl_easy_init() ){
+        setCommonOptions(curl, url, context);
+        curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, onHeader);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, &remote);
+        const int64_t length = (curl_easy_perform(curl) == CURLE_OK)? getContentLength(curl) : -1;
+        if( length >= 0 ){
+            remote.size = length;
+            fetched = true;
+        }else{
+            remote.validator.clear();
+            remote.acceptRanges = false;
+        }
+        curl_easy_cleanup(curl);
+    }
+    return fetched;
+}
+
+static bool seekFile(FILE* file, int64_t offset){
+    // 2GB を超える位置へも移動できるように off_t で指定する
+    return fseeko(file, static_cast<off_t>(offset), SEEK_SET) == 0;
+}
+
+/**
+ * 受信中の途中経過を、複数の範囲のスレッドから記録する
+ * 記録するのは、各スレッドがファイルへ書き出し終えた位置までになる
+ */
+class ZipStateRecorder
+{
+public:
+    ZipStateRecorder(const ZipDownloadState& state, const std::string& path)
+    : _state(state)
+    , _path(path)
+    {}
+    
+    void update(size_t index, int64_t received){
+        std::lock_guard<std::mutex> lock(_mutex);
+        _state.ranges[index].received = received;
+        _state.save(_path);
+    }
+
+private:
+    ZipDownloadState _state;
+    const std::string _path;
+    std::mutex _mutex;
+};
+
+/**
+ * 1つの範囲を、受信済みの位置から続けてダウンロードする
+ */
+struct RangeTransfer {
+    CURL* curl;
+    ZipTransferContext* context;
+    FILE* file;
+    ZipDownloadState::Range* range;
+    ZipStateRecorder* recorder;
+    size_t rangeIndex;
+    ZipClock::time_point lastSaved;
+    bool requestedRange;
+    bool checked;
+    /// 範囲指定が無視されて、始めから送られてきた
+    bool rejected;
+};
+
+static size_t onRangeWrite(char* ptr, size_t size, size_t nmemb, void* userdata){
+    const size_t length = size * nmemb;
+    auto transfer = static_cast<RangeTransfer*>(userdata);
+    ZipDownloadState::Range& range = *transfer->range;
+    if( transfer->context->isAborted() ){
+        return 0;
+    }
+    if( !transfer->checked ){
+        transfer->checked = true;
+        long code = 0;
+        curl_easy_getinfo(transfer->curl, CURLINFO_RESPONSE_CODE, &code);
+        if( transfer->requestedRange && code != 206 ){
+            // 先頭からの範囲であれば、そのまま始めから受け取り直せる
+            if( range.begin != 0 ){
+                transfer->rejected = true;
+                return 0;
+            }
+            range.received = 0;
+            if( !seekFile(transfer->file, 0) ){
+                return 0;
+            }
+        }
+    }
+    if( range.end >= 0 && range.begin + range.received + static_cast<int64_t>(length) > range.end ){
+        CCLOG("ZipDownloader: too much data for range %lld-%lld", static_cast<long long>(range.begin), static_cast<long long>(range.end));
+        return 0;
+    }
+    if( fwrite(ptr, length, 1, transfer->file) != 1 ){
+        return 0;
+    }
+    range.received += length;
+    transfer->context->addDownloaded(length);
+    // 強制終了されても続きから再開できるように、書き出してから受信済みのサイズを記録する
+    const auto now = ZipClock::now();
+    if( now - transfer->lastSaved >= std::chrono::seconds(STATE_SAVE_INTERVAL_SECONDS) && fflush(transfer->file) == 0 ){
+        transfer->lastSaved = now;
+        transfer->recorder->update(transfer->rangeIndex, range.received);
+    }
+    return length;
+}
+
+/**
+ * @return 範囲指定が無視されたら false (途中経過は使えない)
+ */
+static bool downloadRange(const std::string& path, ZipDownloadState& state, size_t rangeIndex, ZipStateRecorder& recorder, ZipTransferContext& context){
+    ZipDownloadState::Range& range = state.ranges[rangeIndex];
+    FILE* file = fopen(path.c_str(), "r+b");
+    if( !file ){
+        CCLOG("ZipDownloader: failed to open %s", path.c_str());
+        return true;
+    }
+    if( !seekFile(file, range.begin + range.received) ){
+        CCLOG("ZipDownloader: failed to seek %s", path.c_str());
+        fclose(file);
+        return true;
+    }
+    RangeTransfer transfer = { nullptr, &context, file, &range, &recorder, rangeIndex, ZipClock::now(), false, false, false };
+    if( CURL* curl = curl_easy_init() ){
+        transfer.curl = curl;
+        setCommonOptions(curl, state.url, context);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, onRangeWrite);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &transfer);
+        
+        const int64_t offset = range.begin + range.received;
+        struct curl_slist* headers = nullptr;
+        if( offset > 0 || (range.end >= 0 && range.end != state.size) ){
+            std::string value = StringUtils::format("%lld-", static_cast<long long>(offset));
+            if( range.end >= 0 ){
+                value += StringUtils::format("%lld", static_cast<long long>(range.end - 1));
+            }
+            curl_easy_setopt(curl, CURLOPT_RANGE, value.c_str());
+            transfer.requestedRange = true;
+            // 内容が変わっていれば、範囲指定を無視して全体を返させる
+            if( !state.validator.empty() ){
+                headers = curl_slist_append(headers, ("If-Range: " + state.validator).c_str());
+                curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+            }
+        }
+        const CURLcode code = curl_easy_perform(curl);
+        if( code == CURLE_OK && range.end < 0 ){
+            // サイズが分からなかったので、受信し終えた位置を終わりとする
+            range.end = range.begin + range.received;
+        }else if( code != CURLE_OK && !transfer.rejected && !context.isAborted() ){
+            CCLOG("ZipDownloader: %s %s", curl_easy_strerror(code), state.url.c_str());
+        }
+        curl_slist_free_all(headers);
+        curl_easy_cleanup(curl);
+    }
+    fclose(file);
+    return !transfer.rejected;
+}
+
+/**
+ * zipファイルを path へダウンロードしてから、ワーカースレッドで finish を呼ぶ
+ * 中断されても、次回は同じURLで内容が変わっていなければ続きからダウンロードする
+ */
+static void startResumable(const std::string& url, const std::string& path, const ZipDownloader::Options& options, const ZipTransferContextPtr& context, const std::function<bool(const std::string& path)>& finish, const ccZipDownloaderCallback& callback){
+    std::thread([url, path, options, context, finish, callback](){
+        const auto start = ZipClock::now();
+        FileUtils::getInstance()->createDirectory(path.substr(0, path.rfind('/') + 1));
+        const std::string statePath = path + ".info";
+        
+        ZipDownloadState state;
+        const bool fetched = fetchRemoteState(url, *context, state);
+        if( context->isAborted() ){
+            // 途中経過はそのまま残しておく
+            postResult(context, false, options.resultCallback, callback);
+            return;
+        }
+        ZipDownloadState saved;
+        const bool hasSaved = saved.load(statePath) && saved.url == url && FileUtils::getInstance()->isFileExist(path);
+        if( !fetched && hasSaved ){
+            // HEAD に失敗しても、途中経過は捨てない
+            // 検証用の値があれば If-Range で続きを要求し、内容が変わっていれば範囲指定が無視されて始めからになる
+            if( saved.validator.empty() ){
+                CCLOG("ZipDownloader: failed to check %s", url.c_str());
+                postResult(context, false, options.resultCallback, callback);
+                return;
+            }
+            state = saved;
+        }
+        if( hasSaved && saved.canResume(state) ){
+            state.ranges = saved.ranges;
+            // 1つの範囲は先頭から順に書き込むので、強制終了されてもファイルのサイズまでは受信できている
+            if( state.ranges.size() == 1 ){
+                auto& range = state.ranges.front();
+                int64_t received = FileUtils::getInstance()->getFileSize(path);
+                if( range.end >= 0 ){
+                    received = std::min(received, range.end);
+                }
+                range.received = std::max(range.received, received);
+            }
+        }else{
+            state.reset(std::max(1, options.rangeConnections));
+            FILE* file = fopen(path.c_str(), "wb");
+            if( file ){
+                fclose(file);
+            }
+        }
+        // 記録されている受信済みのサイズが実際より小さくても、その位置から受信し直すだけで済む
+        state.save(statePath);
+        context->totalBytes = state.size;
+        for( const auto& range : state.ranges ){
+            context->downloadedBytes += range.received;
+        }
+        
+        // 残っている範囲を同時にダウンロードする
+        std::vector<std::thread> threads;
+        std::atomic<bool> rejected(false);
+        ZipStateRecorder recorder(state, statePath);
+        for( size_t lp = 0; lp < state.ranges.size(); ++lp ){
+            if( state.ranges[lp].isComplete() ){
+                continue;
+            }
+            threads.emplace_back([&path, &state, &recorder, &rejected, &context, lp](){
+                if( !downloadRange(path, state, lp, recorder, *context) ){
+                    rejected = true;
+                }
+            });
+        }
+        for( auto& thread : threads ){
+            thread.join();
+        }
+        context->networkNanos += elapsedNanos(start);
+        
+        bool succeeded = false;
+        if( rejected ){
+            CCLOG("ZipDownloader: range request rejected %s", url.c_str());
+            ::remove(path.c_str());
+            ::remove(statePath.c_str());
+        }else if( !state.isComplete() ){
+            if( state.isResumable() ){
+                // 次回は続きからダウンロードする
+                state.save(statePath);
+            }else{
+                ::remove(path.c_str());
+                ::remove(statePath.c_str());
+            }
+        }else{
+            if( state.size < 0 || FileUtils::getInstance()->getFileSize(path) == state.size ){
+                succeeded = finish(path);
+            }
+            // 展開中に中断されたら、次回はダウンロードせずに展開し直せるように残しておく
+            if( succeeded || !context->isAborted() ){
+                ::remove(path.c_str());
+                ::remove(statePath.c_str());
+            }
+        }
+        postResult(context, succeeded, options.resultCallback, callback);
+    }).detach();
 }
 
 #pragma mark - ZipDownloader Class
 
 static ZipDownloader *s_pZipDownloader = nullptr; // pointer to singleton
+static std::once_flag s_curlInitFlag;
+
+void ZipDownloader::initialize(){
+    std::call_once(s_curlInitFlag, [](){
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+    });
+}
 
 ZipDownloader* ZipDownloader::getInstance(){
     if (s_pZipDownloader == nullptr) {
@@ -82,26 +1510,103 @@ void ZipDownloader::destroyInstance(){
     CC_SAFE_DELETE(s_pZipDownloader);
 }
 
-ZipDownloader::ZipDownloader()
+ZipDownloader::Options::Options()
+: streaming(false)
+, extractThreads(0)
+, maxPendingWriteBytes(8 * 1024 * 1024)
+, incremental(false)
+, removeStaleFiles(false)
+, resumable(false)
+, rangeConnections(1)
+, progressCallback(nullptr)
+, progressInterval(0.1f)
+, resultCallback(nullptr)
+, abortFlag(nullptr)
 {}
 
+ZipDownloader::ZipDownloader()
+{
+    // 起動時に呼ばれていなければ、ここで初期化する
+    initialize();
+}
+
 ZipDownloader::~ZipDownloader(){
 }
 
+void ZipDownloader::setMaxConcurrentExtractions(int32_t count){
+    CC_ASSERT(count >= 0);
+    s_extractionSlots.setLimit(count);
+}
+
+int32_t ZipDownloader::getMaxConcurrentExtractions() const {
+    return s_extractionSlots.getLimit();
+}
+
 void ZipDownloader::download(const std::string& url, const std::string& outdir, const ccZipDownloaderCallback& callback){
+    download(url, outdir, callback, Options());
+}
+
+void ZipDownloader::download(const std::string& url, const std::string& outdir, const ccZipDownloaderCallback& callback, const Options& options){
+    auto context = std::make_shared<ZipTransferContext>(options);
+    if( options.streaming ){
+        startStreaming(url, outdir, options, context, callback);
+        return;
+    }
+    
+    // 展開に使うスレッド数 (GLスレッドの分を残しておく)
+    int32_t numThreads = options.extractThreads;
+    if( numThreads <= 0 ){
+        numThreads = std::max(1, static_cast<int32_t>(std::thread::hardware_concurrency()) - 1);
+    }
+    
+    if( options.resumable || options.rangeConnections > 1 ){
+        const bool incremental = options.incremental;
+        const bool removeStaleFiles = options.removeStaleFiles;
+        startResumable(url, outdir + ".zipdownload", options, context, [outdir, numThreads, incremental, removeStaleFiles, context](const std::string& path){
+            ziputil::MappedFile archive;
+            return archive.open(path) && extractArchive(archive.getData(), archive.getSize(), outdir, numThreads, incremental, removeStaleFiles, *context);
+        }, callback);
+        return;
+    }
+    
     auto req = new (std::nothrow) network::HttpRequest();
     req->setRequestType(network::HttpRequest::Type::GET);
     req->setUrl(url);
-    req->setResponseCallback([callback, outdir](network::HttpClient* client, network::HttpResponse* response){
-        if( response->isSucceed() ){
+    const auto start = ZipClock::now();
+    req->setResponseCallback([callback, outdir, numThreads, options, context, start](network::HttpClient* client, network::HttpResponse* response){
+        // HttpClient は受信を終えるまで進捗が分からない
+        context->networkNanos += elapsedNanos(start);
+        const int64_t size = response->getResponseData()->size();
+        context->totalBytes = size;
+        context->addDownloaded(size);
+        // HttpClient は通信を中断できないので、受信を終えてから中断する
+        if( response->isSucceed() && !context->isAborted() ){
             // ダウンロードしたzipファイルを展開スレッドへ送る
-            pushToUnzip(callback, outdir, response);
+            pushToUnzip(callback, outdir, numThreads, options, context, response);
         }else{
-            callback(false);
+            if(options.resultCallback){ options.resultCallback(context->makeResult(false)); }
+            if(callback){ callback(false); }
         }
     });
     network::HttpClient::getInstance()->send( req );
     req->release();
 }
 
+void ZipDownloader::downloadAndMount(const std::string& url, const std::string& path, const ccZipDownloaderCallback& callback){
+    downloadAndMount(url, path, callback, Options());
+}
+
+void ZipDownloader::downloadAndMount(const std::string& url, const std::string& path, const ccZipDownloaderCallback& callback, const Options& options){
+    // 展開しないので、ダウンロードを終えたファイルをそのまま置き換える
+    // マウント中のファイルを置き換えても、メモリマップされている元のファイルは unmount されるまで残る
+    auto context = std::make_shared<ZipTransferContext>(options);
+    startResumable(url, path + ".zipdownload", options, context, [path](const std::string& downloadedPath){
+        if( rename(downloadedPath.c_str(), path.c_str()) != 0 ){
+            CCLOG("ZipDownloader: failed to rename %s", path.c_str());
+            return false;
+        }
+        return ZipFileSystem::getInstance()->mount(path);
+    }, callback);
+}
+
 NS_CC_EXT_END
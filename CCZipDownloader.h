@@ -7,6 +7,7 @@
 
 #include "cocos2d.h"
 #include "ExtensionMacros.h"
+#include <atomic>
 
 NS_CC_EXT_BEGIN
 
@@ -30,10 +31,151 @@ public:
     /** Relase the shared instance **/
     static void destroyInstance();
     
+    /**
+     * curl を初期化する (2回目以降は何もしない)
+     * curl_global_init はスレッドセーフではないので、アプリの起動時に他のスレッドが通信を始める前に呼んでおく
+     */
+    static void initialize();
+    
+    /**
+     * 進捗 (GLスレッドへ一定間隔で送られる)
+     */
+    struct Progress {
+        /// 受信したバイト数 (再開したダウンロードでは、前回までに受信した分を含む)
+        int64_t downloadedBytes;
+        /// zipファイルのサイズ (分からなければ -1)
+        int64_t totalBytes;
+        /// 展開したバイト数
+        int64_t inflatedBytes;
+        /// 書き込みを終えたファイルの数
+        int32_t writtenFiles;
+        /// 書き込むファイルの数 (分からなければ -1)
+        int32_t totalFiles;
+        /// 前回の通知からの速度 (MB/s)
+        float downloadRate;
+        float inflateRate;
+        /// 前回の通知からの速度 (files/s)
+        float fileRate;
+    };
+    
+    /**
+     * 結果と各段階にかかった時間
+     * 展開と書き込みは、複数のスレッドで並行した時間を合計する
+     */
+    struct Result {
+        bool succeeded;
+        int64_t downloadedBytes;
+        int64_t inflatedBytes;
+        int32_t writtenFiles;
+        /// 受信を待っていた時間 (秒)
+        float networkTime;
+        /// 展開にかかった時間 (秒)
+        float inflateTime;
+        /// ファイルを開いて書き込み、閉じるまでにかかった時間 (秒)
+        float writeTime;
+        /// 開始から終了までの時間 (秒)
+        float totalTime;
+    };
+    
+    typedef std::function<void(const Progress& progress)> ProgressCallback;
+    typedef std::function<void(const Result& result)> ResultCallback;
+    
+    /**
+     * ダウンロードと展開の設定
+     */
+    struct Options {
+        /**
+         * ダウンロードしながら展開する (default: false)
+         * zipファイル全体をメモリへ読み込まずに、届いたデータから順にローカルファイルヘッダを辿って展開する
+         */
+        bool streaming;
+        
+        /**
+         * ダウンロード後に展開するスレッドの数 (default: 0)
+         * 0 であればコア数から1を引いた数を使う。streaming では使われない
+         */
+        int32_t extractThreads;
+        
+        /**
+         * streaming で、書き込みを待つデータ量の上限 (default: 8MB)
+         * 書き込みが追いつかずに上限の半分を超えたら、受信を一時停止して待つ
+         */
+        size_t maxPendingWriteBytes;
+        
+        /**
+         * 前回と同じ内容のファイルを展開しない (default: false)
+         * 展開したファイルのCRCとサイズを outdir の .zipmanifest へ記録しておき、zipファイルのCRCとサイズが一致するファイルは読み飛ばす
+         * streaming では、データディスクリプタを使うファイルは常に展開する
+         */
+        bool incremental;
+        
+        /**
+         * 前回展開したファイルのうち、zipファイルに含まれなくなったものを削除する (default: false)
+         * .zipmanifest に記録されたファイルだけが対象になる
+         */
+        bool removeStaleFiles;
+        
+        /**
+         * 中断されたダウンロードを続きから再開する (default: false)
+         * zipファイルを outdir の .zipdownload へ保存してから展開する
+         * 同じURLで、ETag (無ければ Last-Modified) とサイズが変わっていなければ、Range で続きを要求する
+         * HEAD で確かめられなくても、ETag (無ければ Last-Modified) が記録されていれば If-Range を付けて続きを要求する
+         * streaming では使われない
+         */
+        bool resumable;
+        
+        /**
+         * zipファイルを範囲に分けて、同時にダウンロードする数 (default: 1)
+         * 2以上であれば resumable と同じく .zipdownload へ保存する
+         * サーバーが Range に対応していなければ、1つにまとめてダウンロードする
+         */
+        int32_t rangeConnections;
+        
+        /**
+         * 進捗を受け取る (default: nullptr)
+         * streaming でも resumable でもなければ、受信中の進捗は分からないので、受信を終えてから通知される
+         */
+        ProgressCallback progressCallback;
+        
+        /**
+         * 進捗を通知する間隔 (秒) (default: 0.1)
+         */
+        float progressInterval;
+        
+        /**
+         * 結果と各段階にかかった時間を受け取る (default: nullptr)
+         * ccZipDownloaderCallback の直前に呼ばれる
+         */
+        ResultCallback resultCallback;
+        
+        /**
+         * true にすると、受信と展開を中断して失敗として終わる (default: nullptr)
+         * resumable であれば、受信した分は次回のために残される
+         */
+        std::shared_ptr<std::atomic<bool>> abortFlag;
+        
+        Options();
+    };
+    
+    /**
+     * ダウンロードを終えたzipファイルを、同時に展開する数の上限を設定 (default: 0)
+     * 0 であれば制限しない。上限に達していれば、空くまで展開を待つ。streaming では使われない
+     */
+    void setMaxConcurrentExtractions(int32_t count);
+    int32_t getMaxConcurrentExtractions() const;
+    
     /**
      * urlで指定されたzipファイルをダウンロードし、outdirへ展開する
      */
     void download(const std::string& url, const std::string& outdir, const ccZipDownloaderCallback& callback);
+    void download(const std::string& url, const std::string& outdir, const ccZipDownloaderCallback& callback, const Options& options);
+    
+    /**
+     * urlで指定されたzipファイルを展開せずに path へダウンロードし、ZipFileSystem へマウントする
+     * 中断されても続きからダウンロードする。options の rangeConnections 以外は使われない
+     */
+    void downloadAndMount(const std::string& url, const std::string& path, const ccZipDownloaderCallback& callback);
+    void downloadAndMount(const std::string& url, const std::string& path, const ccZipDownloaderCallback& callback, const Options& options);
     
 private:
     ZipDownloader();
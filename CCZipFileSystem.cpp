@@ -0,0 +1,304 @@
+/****************************************************************************
+ Copyright (c) Yassy
+ https://github.com/yassy0413/cocos2dx-3.x-util
+ ****************************************************************************/
+#include "CCZipFileSystem.h"
+#include <atomic>
+
+// FileUtils を継承できるのは、コンストラクタが公開されているプラットフォームだけ
+#if CC_TARGET_PLATFORM == CC_PLATFORM_IOS || CC_TARGET_PLATFORM == CC_PLATFORM_MAC
+#include "platform/apple/CCFileUtils-apple.h"
+#define ZIP_FILE_SYSTEM_PLATFORM_FILE_UTILS FileUtilsApple
+#elif CC_TARGET_PLATFORM == CC_PLATFORM_ANDROID
+#include "platform/android/CCFileUtils-android.h"
+#define ZIP_FILE_SYSTEM_PLATFORM_FILE_UTILS FileUtilsAndroid
+#endif
+
+NS_CC_EXT_BEGIN
+
+#ifdef ZIP_FILE_SYSTEM_PLATFORM_FILE_UTILS
+
+/**
+ * マウントしたzipファイルを先に探し、見つからなければ元の FileUtils へ任せる
+ */
+class ZipFileUtils
+: public ZIP_FILE_SYSTEM_PLATFORM_FILE_UTILS
+{
+public:
+    typedef ZIP_FILE_SYSTEM_PLATFORM_FILE_UTILS Super;
+    
+    virtual std::string fullPathForFilename(const std::string& filename) const override {
+        const std::string path = ZipFileSystem::getInstance()->fullPathForFilename(filename);
+        return path.empty()? Super::fullPathForFilename(filename) : path;
+    }
+    
+    virtual bool isFileExist(const std::string& filename) const override {
+        return ZipFileSystem::getInstance()->isFileExist(filename) || Super::isFileExist(filename);
+    }
+    
+    virtual Data getDataFromFile(const std::string& filename) override {
+        Data data;
+        if( ZipFileSystem::getInstance()->getDataFromFile(filename, data) ){
+            return data;
+        }
+        return Super::getDataFromFile(filename);
+    }
+    
+    virtual std::string getStringFromFile(const std::string& filename) override {
+        Data data;
+        if( ZipFileSystem::getInstance()->getDataFromFile(filename, data) ){
+            return std::string(reinterpret_cast<const char*>(data.getBytes()), data.getSize());
+        }
+        return Super::getStringFromFile(filename);
+    }
+};
+
+#endif
+
+#pragma mark - ZipFileSystem
+
+static std::atomic<ZipFileSystem*> s_pZipFileSystem(nullptr); // pointer to singleton
+static std::mutex s_instanceMutex;
+
+ZipFileSystem* ZipFileSystem::getInstance(){
+    // ZipDownloader のスレッドや TextureCache の読み込みスレッドからも呼ばれるので、作成する時だけロックする
+    ZipFileSystem* instance = s_pZipFileSystem;
+    if (instance == nullptr) {
+        std::lock_guard<std::mutex> lock(s_instanceMutex);
+        instance = s_pZipFileSystem;
+        if (instance == nullptr) {
+            instance = new (std::nothrow) ZipFileSystem();
+            s_pZipFileSystem = instance;
+        }
+    }
+    return instance;
+}
+
+void ZipFileSystem::destroyInstance(){
+    std::lock_guard<std::mutex> lock(s_instanceMutex);
+    delete s_pZipFileSystem.exchange(nullptr);
+}
+
+bool ZipFileSystem::installFileUtils(){
+#ifdef ZIP_FILE_SYSTEM_PLATFORM_FILE_UTILS
+    auto fileUtils = new (std::nothrow) ZipFileUtils();
+    if( !fileUtils || !fileUtils->init() ){
+        CC_SAFE_DELETE(fileUtils);
+        return false;
+    }
+    FileUtils* current = FileUtils::getInstance();
+    fileUtils->setSearchResolutionsOrder(current->getSearchResolutionsOrder());
+    fileUtils->setSearchPaths(current->getSearchPaths());
+    // 元の FileUtils は破棄される
+    FileUtils::setDelegate(fileUtils);
+    return true;
+#else
+    CCLOG("ZipFileSystem: FileUtils is not supported on this platform");
+    return false;
+#endif
+}
+
+ZipFileSystem::ZipFileSystem()
+: _cacheCapacity(4 * 1024 * 1024)
+, _cacheBytes(0)
+{}
+
+ZipFileSystem::~ZipFileSystem(){
+}
+
+bool ZipFileSystem::mount(const std::string& path){
+    auto archive = std::make_shared<Archive>();
+    archive->path = path;
+    if( !archive->file.open(path) ){
+        CCLOG("ZipFileSystem: failed to open %s", path.c_str());
+        return false;
+    }
+    if( !ziputil::readCentralDirectory(archive->file.getData(), archive->file.getSize(), archive->entries) ){
+        CCLOG("ZipFileSystem: invalid zip file %s", path.c_str());
+        return false;
+    }
+    
+    std::lock_guard<std::mutex> lock(_mutex);
+    for( auto it = _archives.begin(); it != _archives.end(); ++it ){
+        if( (*it)->path == path ){
+            _archives.erase(it);
+            break;
+        }
+    }
+    // 同じパスで置き換えたzipファイルは、キャッシュのキーが同じでも内容が違う
+    purgeCache(path);
+    _archives.push_back(archive);
+    rebuildIndex();
+    return true;
+}
+
+void ZipFileSystem::unmount(const std::string& path){
+    std::lock_guard<std::mutex> lock(_mutex);
+    for( auto it = _archives.begin(); it != _archives.end(); ++it ){
+        if( (*it)->path == path ){
+            _archives.erase(it);
+            purgeCache(path);
+            rebuildIndex();
+            return;
+        }
+    }
+}
+
+bool ZipFileSystem::isMounted(const std::string& path) const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for( const auto& archive : _archives ){
+        if( archive->path == path ){
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string ZipFileSystem::fullPathForFilename(const std::string& filename) const {
+    Location location;
+    if( !find(filename, location) ){
+        return "";
+    }
+    return location.archive->path + "/" + location.entry->filename;
+}
+
+bool ZipFileSystem::isFileExist(const std::string& filename) const {
+    Location location;
+    return find(filename, location);
+}
+
+bool ZipFileSystem::getDataFromFile(const std::string& filename, Data& outData){
+    Location location;
+    if( !find(filename, location) ){
+        return false;
+    }
+    const ziputil::Entry& entry = *location.entry;
+    const Archive& archive = *location.archive;
+    const unsigned char* data = archive.file.getData();
+    const size_t size = archive.file.getSize();
+    
+    // 無圧縮であれば、メモリマップからそのままコピーする
+    if( entry.method == ziputil::METHOD_STORED ){
+        const unsigned char* stored = ziputil::findEntryData(data, size, entry);
+        if( !stored || entry.compressedSize != entry.uncompressedSize ){
+            return false;
+        }
+        outData.copy(stored, entry.compressedSize);
+        return true;
+    }
+    
+    const std::string key = archive.path + "/" + entry.filename;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _cache.find(key);
+        if( it != _cache.end() ){
+            _lru.splice(_lru.begin(), _lru, it->second.lru);
+            outData.copy(it->second.data.data(), it->second.data.size());
+            return true;
+        }
+    }
+    
+    // 展開は他のスレッドを待たせないように、ロックせずに行う
+    std::vector<unsigned char> buffer;
+    buffer.reserve(entry.uncompressedSize);
+    const bool succeeded = ziputil::extract(data, size, entry, [&buffer](const unsigned char* data, size_t size){
+        buffer.insert(buffer.end(), data, data + size);
+        return true;
+    });
+    if( !succeeded ){
+        CCLOG("ZipFileSystem: failed to extract %s", key.c_str());
+        return false;
+    }
+    outData.copy(buffer.data(), buffer.size());
+    
+    std::lock_guard<std::mutex> lock(_mutex);
+    // 展開している間に unmount されたか、同じパスへ別のzipファイルがマウントされていれば、キャッシュには残さない
+    auto mounted = _fullPaths.find(key);
+    if( mounted != _fullPaths.end() && mounted->second.archive == location.archive && buffer.size() <= _cacheCapacity && _cache.count(key) == 0 ){
+        CacheEntry& cacheEntry = _cache[key];
+        cacheEntry.data.swap(buffer);
+        cacheEntry.lru = _lru.insert(_lru.begin(), key);
+        _cacheBytes += cacheEntry.data.size();
+        trim(_cacheCapacity);
+    }
+    return true;
+}
+
+void ZipFileSystem::setCacheCapacity(size_t bytes){
+    std::lock_guard<std::mutex> lock(_mutex);
+    _cacheCapacity = bytes;
+    trim(_cacheCapacity);
+}
+
+size_t ZipFileSystem::getCacheCapacity() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _cacheCapacity;
+}
+
+void ZipFileSystem::rebuildIndex(){
+    _filenames.clear();
+    _fullPaths.clear();
+    for( const auto& archive : _archives ){
+        for( const auto& entry : archive->entries ){
+            if( entry.isDirectory() ){
+                continue;
+            }
+            Location location;
+            location.archive = archive;
+            location.entry = &entry;
+            // 後からマウントしたzipファイルで上書きする
+            _filenames[entry.filename] = location;
+            _fullPaths[archive->path + "/" + entry.filename] = location;
+        }
+    }
+    
+    // マウントしていないzipファイルのキャッシュを捨てる
+    for( auto it = _lru.begin(); it != _lru.end(); ){
+        if( _fullPaths.count(*it) == 0 ){
+            auto entry = _cache.find(*it);
+            _cacheBytes -= entry->second.data.size();
+            _cache.erase(entry);
+            it = _lru.erase(it);
+        }else{
+            ++it;
+        }
+    }
+}
+
+void ZipFileSystem::purgeCache(const std::string& path){
+    const std::string prefix = path + "/";
+    for( auto it = _lru.begin(); it != _lru.end(); ){
+        if( it->compare(0, prefix.size(), prefix) == 0 ){
+            auto entry = _cache.find(*it);
+            _cacheBytes -= entry->second.data.size();
+            _cache.erase(entry);
+            it = _lru.erase(it);
+        }else{
+            ++it;
+        }
+    }
+}
+
+bool ZipFileSystem::find(const std::string& filename, Location& outLocation) const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _fullPaths.find(filename);
+    if( it == _fullPaths.end() ){
+        it = _filenames.find(filename);
+        if( it == _filenames.end() ){
+            return false;
+        }
+    }
+    outLocation = it->second;
+    return true;
+}
+
+void ZipFileSystem::trim(size_t capacity){
+    while( _cacheBytes > capacity && !_lru.empty() ){
+        auto entry = _cache.find(_lru.back());
+        _cacheBytes -= entry->second.data.size();
+        _cache.erase(entry);
+        _lru.pop_back();
+    }
+}
+
+NS_CC_EXT_END
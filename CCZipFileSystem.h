@@ -0,0 +1,121 @@
+/****************************************************************************
+ Copyright (c) Yassy
+ https://github.com/yassy0413/cocos2dx-3.x-util
+ ****************************************************************************/
+#ifndef __CC_ZIP_FILE_SYSTEM_H__
+#define __CC_ZIP_FILE_SYSTEM_H__
+
+#include "cocos2d.h"
+#include "ExtensionMacros.h"
+#include "CCZipUtil.h"
+#include <mutex>
+
+NS_CC_EXT_BEGIN
+
+/**
+ * zipファイルを展開せずに、FileUtils の検索パスのように扱う
+ *
+ * zipファイルはメモリマップされ、中央ディレクトリからファイル名の索引を作る。
+ * 無圧縮のファイルはメモリマップからそのままコピーし、
+ * 圧縮されたファイルは展開した結果を容量制限付きでキャッシュする。
+ * どのスレッドからでも利用できる。
+ *
+ @code
+ ZipFileSystem::installFileUtils();
+ ZipFileSystem::getInstance()->mount(FileUtils::getInstance()->getWritablePath() + "dlc.zip");
+ auto sprite = Sprite::create("dlc/chara.png");
+ @endcode
+ */
+class ZipFileSystem
+{
+public:
+    CC_DISALLOW_COPY_AND_ASSIGN(ZipFileSystem);
+    
+    /** Return the shared instance **/
+    static ZipFileSystem *getInstance();
+    
+    /** Relase the shared instance **/
+    static void destroyInstance();
+    
+    /**
+     * FileUtils を、マウントしたzipファイルを先に探すものへ置き換える
+     * 検索パスと解像度の検索順は引き継がれる。テクスチャの読み込みなどを始める前に呼ぶこと
+     * @return 対応していないプラットフォームであれば false
+     */
+    static bool installFileUtils();
+    
+    /**
+     * zipファイルをマウントする
+     * 同じファイル名があれば、後からマウントしたzipファイルが優先される。マウント済みであればマウントし直す
+     * @return 開けないか、zipファイルとして解釈できなければ false
+     */
+    bool mount(const std::string& path);
+    
+    void unmount(const std::string& path);
+    bool isMounted(const std::string& path) const;
+    
+    /**
+     * マウントしたzipファイルから filename を探す
+     * @return "zipファイルのパス/ファイル名" の形式のフルパス。見つからなければ空
+     */
+    std::string fullPathForFilename(const std::string& filename) const;
+    
+    /**
+     * filename (zipファイル内の相対パスか、fullPathForFilename で得たフルパス) があるかどうか
+     */
+    bool isFileExist(const std::string& filename) const;
+    
+    /**
+     * filename の内容を取得
+     * @return 見つからないか、壊れていれば false
+     */
+    bool getDataFromFile(const std::string& filename, Data& outData);
+    
+    /**
+     * 展開したファイルのキャッシュの容量 (bytes) を設定 (default: 4MB)
+     */
+    void setCacheCapacity(size_t bytes);
+    size_t getCacheCapacity() const;
+
+private:
+    struct Archive {
+        std::string path;
+        ziputil::MappedFile file;
+        std::vector<ziputil::Entry> entries;
+    };
+    
+    struct Location {
+        /// 読み込み中に unmount されても、読み終えるまでは残す
+        std::shared_ptr<const Archive> archive;
+        const ziputil::Entry* entry;
+    };
+    
+    struct CacheEntry {
+        std::vector<unsigned char> data;
+        std::list<std::string>::iterator lru;
+    };
+    
+    ZipFileSystem();
+    ~ZipFileSystem();
+    
+    void rebuildIndex();
+    /// path のzipファイルから展開したキャッシュを捨てる
+    void purgeCache(const std::string& path);
+    bool find(const std::string& filename, Location& outLocation) const;
+    void trim(size_t capacity);
+    
+    mutable std::mutex _mutex;
+    /// マウントした順
+    std::vector<std::shared_ptr<const Archive>> _archives;
+    std::unordered_map<std::string, Location> _filenames;
+    std::unordered_map<std::string, Location> _fullPaths;
+    std::unordered_map<std::string, CacheEntry> _cache;
+    /// 先頭が最も新しい
+    std::list<std::string> _lru;
+    size_t _cacheCapacity;
+    size_t _cacheBytes;
+};
+
+NS_CC_EXT_END
+
+#endif
@@ -0,0 +1,325 @@
+/****************************************************************************
+ Copyright (c) Yassy
+ https://github.com/yassy0413/cocos2dx-3.x-util
+ ****************************************************************************/
+#include "CCZipUtil.h"
+#include "zlib.h"
+#if CC_ZIP_USE_ZSTD
+#include "zstd.h"
+#endif
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+NS_CC_EXT_BEGIN
+
+namespace ziputil {
+    
+    namespace {
+        /// 展開の出力単位
+        const size_t OUTPUT_BUFFER_SIZE = 64 * 1024;
+    }
+    
+    int readLocalFileHeader(const unsigned char* data, size_t size, LocalFileHeader& outHeader){
+        if( size < 4 ){
+            return 0;
+        }
+        if( readUInt32(data) != LOCAL_FILE_HEADER_SIGNATURE ){
+            return -1;
+        }
+        if( size < LOCAL_FILE_HEADER_SIZE ){
+            return 0;
+        }
+        const uint16_t filenameLength = readUInt16(data + 26);
+        const uint16_t extraLength = readUInt16(data + 28);
+        const size_t headerSize = LOCAL_FILE_HEADER_SIZE + filenameLength + extraLength;
+        if( size < headerSize ){
+            return 0;
+        }
+        outHeader.flags = readUInt16(data + 6);
+        outHeader.method = readUInt16(data + 8);
+        outHeader.crc32 = readUInt32(data + 14);
+        outHeader.compressedSize = readUInt32(data + 18);
+        outHeader.uncompressedSize = readUInt32(data + 22);
+        outHeader.filename.assign(reinterpret_cast<const char*>(data + LOCAL_FILE_HEADER_SIZE), filenameLength);
+        outHeader.headerSize = headerSize;
+        return 1;
+    }
+    
+    bool readCentralDirectory(const unsigned char* data, size_t size, std::vector<Entry>& outEntries){
+        outEntries.clear();
+        if( size < END_OF_CENTRAL_DIRECTORY_SIZE ){
+            return false;
+        }
+        // 終端レコードは、最大 65535 bytes のコメントの前にある
+        const size_t searchEnd = (size > END_OF_CENTRAL_DIRECTORY_SIZE + 0xffff)? size - END_OF_CENTRAL_DIRECTORY_SIZE - 0xffff : 0;
+        const unsigned char* eocd = nullptr;
+        for( size_t offset = size - END_OF_CENTRAL_DIRECTORY_SIZE + 1; offset-- > searchEnd; ){
+            if( readUInt32(data + offset) == END_OF_CENTRAL_DIRECTORY_SIGNATURE ){
+                eocd = data + offset;
+                break;
+            }
+        }
+        if( !eocd ){
+            return false;
+        }
+        const uint16_t numEntries = readUInt16(eocd + 10);
+        const uint32_t directorySize = readUInt32(eocd + 12);
+        const uint32_t directoryOffset = readUInt32(eocd + 16);
+        if( static_cast<size_t>(directoryOffset) + directorySize > size ){
+            return false;
+        }
+        
+        outEntries.reserve(numEntries);
+        const unsigned char* p = data + directoryOffset;
+        const unsigned char* end = p + directorySize;
+        for( uint16_t lp = 0; lp < numEntries; ++lp ){
+            if( end - p < static_cast<ptrdiff_t>(CENTRAL_DIRECTORY_ENTRY_SIZE) || readUInt32(p) != CENTRAL_DIRECTORY_SIGNATURE ){
+                return false;
+            }
+            const size_t entrySize = CENTRAL_DIRECTORY_ENTRY_SIZE + readUInt16(p + 28) + readUInt16(p + 30) + readUInt16(p + 32);
+            if( end - p < static_cast<ptrdiff_t>(entrySize) ){
+                return false;
+            }
+            Entry entry;
+            entry.flags = readUInt16(p + 8);
+            entry.method = readUInt16(p + 10);
+            entry.crc32 = readUInt32(p + 16);
+            entry.compressedSize = readUInt32(p + 20);
+            entry.uncompressedSize = readUInt32(p + 24);
+            entry.localHeaderOffset = readUInt32(p + 42);
+            entry.filename.assign(reinterpret_cast<const char*>(p + CENTRAL_DIRECTORY_ENTRY_SIZE), readUInt16(p + 28));
+            outEntries.push_back(std::move(entry));
+            p += entrySize;
+        }
+        return true;
+    }
+    
+    const unsigned char* findEntryData(const unsigned char* data, size_t size, const Entry& entry){
+        // ローカルファイルヘッダの拡張フィールドは、中央ディレクトリと長さが異なることがある
+        const size_t offset = entry.localHeaderOffset;
+        if( offset + LOCAL_FILE_HEADER_SIZE > size || readUInt32(data + offset) != LOCAL_FILE_HEADER_SIGNATURE ){
+            return nullptr;
+        }
+        const size_t dataOffset = offset + LOCAL_FILE_HEADER_SIZE + readUInt16(data + offset + 26) + readUInt16(data + offset + 28);
+        if( dataOffset + entry.compressedSize > size ){
+            return nullptr;
+        }
+        return data + dataOffset;
+    }
+    
+    bool isSafeFilename(const std::string& filename){
+        if( filename.empty() || filename[0] == '/' || filename[0] == '\\' || filename.find(':') != std::string::npos ){
+            return false;
+        }
+        // ディレクトリの区切り毎に .. を探す
+        size_t begin = 0;
+        while( begin <= filename.size() ){
+            size_t end = filename.find_first_of("/\\", begin);
+            if( end == std::string::npos ){
+                end = filename.size();
+            }
+            if( filename.compare(begin, end - begin, "..") == 0 ){
+                return false;
+            }
+            begin = end + 1;
+        }
+        return true;
+    }
+
+#pragma mark -- Decompressor
+    
+    Decompressor::Decompressor(uint16_t method)
+    : _method(method)
+    , _supported(false)
+    , _finished(false)
+    , _stream(nullptr)
+    {
+        switch( method ){
+            case METHOD_STORED:
+                _supported = true;
+                break;
+            case METHOD_DEFLATED: {
+                z_stream* stream = new (std::nothrow) z_stream();
+                // zipの中身はヘッダの無い deflate なので、負のウィンドウサイズを指定する
+                if( stream && inflateInit2(stream, -MAX_WBITS) == Z_OK ){
+                    _stream = stream;
+                    _buffer.resize(OUTPUT_BUFFER_SIZE);
+                    _supported = true;
+                }else{
+                    delete stream;
+                }
+                break;
+            }
+#if CC_ZIP_USE_ZSTD
+            case METHOD_ZSTD: {
+                ZSTD_DStream* stream = ZSTD_createDStream();
+                if( stream && !ZSTD_isError(ZSTD_initDStream(stream)) ){
+                    _stream = stream;
+                    _buffer.resize(std::max(OUTPUT_BUFFER_SIZE, ZSTD_DStreamOutSize()));
+                    _supported = true;
+                }else{
+                    ZSTD_freeDStream(stream);
+                }
+                break;
+            }
+#endif
+            default:
+                break;
+        }
+    }
+    
+    Decompressor::~Decompressor(){
+        if( !_stream ){
+            return;
+        }
+#if CC_ZIP_USE_ZSTD
+        if( _method == METHOD_ZSTD ){
+            ZSTD_freeDStream(static_cast<ZSTD_DStream*>(_stream));
+            return;
+        }
+#endif
+        z_stream* stream = static_cast<z_stream*>(_stream);
+        inflateEnd(stream);
+        delete stream;
+    }
+    
+    bool Decompressor::update(const unsigned char* data, size_t size, size_t& outConsumed, const Output& output){
+        outConsumed = 0;
+        if( !_supported ){
+            return false;
+        }
+        if( _method == METHOD_STORED ){
+            outConsumed = size;
+            return size == 0 || output(data, size);
+        }
+#if CC_ZIP_USE_ZSTD
+        if( _method == METHOD_ZSTD ){
+            return updateZstd(data, size, outConsumed, output);
+        }
+#endif
+        
+        z_stream* stream = static_cast<z_stream*>(_stream);
+        stream->next_in = const_cast<Bytef*>(data);
+        stream->avail_in = static_cast<uInt>(size);
+        while( !_finished ){
+            stream->next_out = _buffer.data();
+            stream->avail_out = static_cast<uInt>(_buffer.size());
+            const int result = inflate(stream, Z_NO_FLUSH);
+            if( result == Z_STREAM_END ){
+                _finished = true;
+            }else if( result != Z_OK && result != Z_BUF_ERROR ){
+                return false;
+            }
+            const size_t produced = _buffer.size() - stream->avail_out;
+            if( produced > 0 && !output(_buffer.data(), produced) ){
+                return false;
+            }
+            // 出力に空きが残っていれば、入力を使い切っている
+            if( stream->avail_out != 0 ){
+                break;
+            }
+        }
+        outConsumed = size - stream->avail_in;
+        return true;
+    }
+
+#if CC_ZIP_USE_ZSTD
+    bool Decompressor::updateZstd(const unsigned char* data, size_t size, size_t& outConsumed, const Output& output){
+        ZSTD_DStream* stream = static_cast<ZSTD_DStream*>(_stream);
+        ZSTD_inBuffer in = { data, size, 0 };
+        while( !_finished ){
+            ZSTD_outBuffer out = { _buffer.data(), _buffer.size(), 0 };
+            const size_t result = ZSTD_decompressStream(stream, &out, &in);
+            if( ZSTD_isError(result) ){
+                return false;
+            }
+            // 0 はフレームの終わりまで展開したことを表す
+            if( result == 0 ){
+                _finished = true;
+            }
+            if( out.pos > 0 && !output(_buffer.data(), out.pos) ){
+                return false;
+            }
+            // 出力に空きが残っていれば、入力を使い切っている
+            if( out.pos < out.size ){
+                break;
+            }
+        }
+        outConsumed = in.pos;
+        return true;
+    }
+#endif
+    
+    bool extract(const unsigned char* data, size_t size, const Entry& entry, const Decompressor::Output& output){
+        const unsigned char* compressed = findEntryData(data, size, entry);
+        if( !compressed ){
+            return false;
+        }
+        Decompressor decompressor(entry.method);
+        uLong crc = crc32(0, Z_NULL, 0);
+        uint64_t written = 0;
+        size_t consumed;
+        const bool succeeded = decompressor.update(compressed, entry.compressedSize, consumed, [&](const unsigned char* data, size_t size){
+            crc = crc32(crc, data, static_cast<uInt>(size));
+            written += size;
+            return output(data, size);
+        });
+        if( !succeeded || consumed != entry.compressedSize || (decompressor.isSelfTerminating() && !decompressor.isFinished()) ){
+            return false;
+        }
+        return crc == entry.crc32 && written == entry.uncompressedSize;
+    }
+
+#pragma mark -- MappedFile
+    
+    MappedFile::MappedFile()
+    : _data(nullptr)
+    , _size(0)
+    {}
+    
+    MappedFile::~MappedFile(){
+        close();
+    }
+    
+    bool MappedFile::open(const std::string& path){
+        close();
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if( fd < 0 ){
+            return false;
+        }
+        struct stat st;
+        if( fstat(fd, &st) == 0 && st.st_size > 0 ){
+            void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if( addr != MAP_FAILED ){
+                _data = addr;
+                _size = static_cast<size_t>(st.st_size);
+            }
+        }
+        ::close(fd);
+        return _data != nullptr;
+    }
+    
+    void MappedFile::prefetch() const {
+        if( !_data ){
+            return;
+        }
+        madvise(_data, _size, MADV_WILLNEED);
+        const unsigned char* p = static_cast<const unsigned char*>(_data);
+        volatile unsigned char touch = 0;
+        for( size_t offset = 0; offset < _size; offset += 4096 ){
+            touch ^= p[offset];
+        }
+    }
+    
+    void MappedFile::close(){
+        if( _data ){
+            munmap(_data, _size);
+            _data = nullptr;
+            _size = 0;
+        }
+    }
+}
+
+NS_CC_EXT_END
@@ -0,0 +1,195 @@
+/****************************************************************************
+ Copyright (c) Yassy
+ https://github.com/yassy0413/cocos2dx-3.x-util
+ ****************************************************************************/
+#ifndef __CC_ZIP_UTIL_H__
+#define __CC_ZIP_UTIL_H__
+
+#include "cocos2d.h"
+#include "ExtensionMacros.h"
+
+/// 1 にすると、zstd で圧縮されたエントリ (method 93) を展開できる (zstd のリンクが必要)
+#ifndef CC_ZIP_USE_ZSTD
+#define CC_ZIP_USE_ZSTD 0
+#endif
+
+NS_CC_EXT_BEGIN
+
+/**
+ * zipファイルの読み込み処理
+ * ワーカースレッドから呼び出せる
+ */
+namespace ziputil {
+    
+    /// 圧縮方式
+    enum : uint16_t {
+        METHOD_STORED = 0,
+        METHOD_DEFLATED = 8,
+        METHOD_ZSTD = 93,
+    };
+    
+    const uint32_t LOCAL_FILE_HEADER_SIGNATURE = 0x04034b50;
+    const uint32_t DATA_DESCRIPTOR_SIGNATURE = 0x08074b50;
+    const uint32_t CENTRAL_DIRECTORY_SIGNATURE = 0x02014b50;
+    const uint32_t END_OF_CENTRAL_DIRECTORY_SIGNATURE = 0x06054b50;
+    
+    /// ローカルファイルヘッダの固定長部分のサイズ
+    const size_t LOCAL_FILE_HEADER_SIZE = 30;
+    /// 中央ディレクトリのエントリの固定長部分のサイズ
+    const size_t CENTRAL_DIRECTORY_ENTRY_SIZE = 46;
+    /// 中央ディレクトリの終端レコードの固定長部分のサイズ
+    const size_t END_OF_CENTRAL_DIRECTORY_SIZE = 22;
+    
+    /**
+     * ローカルファイルヘッダ
+     */
+    struct LocalFileHeader {
+        uint16_t flags;
+        uint16_t method;
+        uint32_t crc32;
+        uint32_t compressedSize;
+        uint32_t uncompressedSize;
+        std::string filename;
+        /// ファイル名と拡張フィールドを含めたヘッダのサイズ
+        size_t headerSize;
+        
+        /// サイズとCRCがデータの後ろ (データディスクリプタ) に記録されている
+        bool hasDataDescriptor() const { return (flags & 0x08) != 0; }
+    };
+    
+    /**
+     * 中央ディレクトリのエントリ
+     */
+    struct Entry {
+        std::string filename;
+        uint16_t flags;
+        uint16_t method;
+        uint32_t crc32;
+        uint32_t compressedSize;
+        uint32_t uncompressedSize;
+        uint32_t localHeaderOffset;
+        
+        bool isDirectory() const { return !filename.empty() && *filename.rbegin() == '/'; }
+    };
+    
+    inline uint16_t readUInt16(const unsigned char* p){
+        return static_cast<uint16_t>(p[0] | (p[1] << 8));
+    }
+    
+    inline uint32_t readUInt32(const unsigned char* p){
+        return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+    }
+    
+    /**
+     * ローカルファイルヘッダを読み込む
+     * @return 読み込めたら 1、データが足りなければ 0、ローカルファイルヘッダでなければ -1
+     */
+    int readLocalFileHeader(const unsigned char* data, size_t size, LocalFileHeader& outHeader);
+    
+    /**
+     * zipファイル全体から、中央ディレクトリのエントリを読み込む
+     * @return zipファイルとして解釈できなければ false
+     */
+    bool readCentralDirectory(const unsigned char* data, size_t size, std::vector<Entry>& outEntries);
+    
+    /**
+     * zipファイル全体から、エントリの圧縮されたデータの位置を取得する
+     * @return 範囲外であれば nullptr
+     */
+    const unsigned char* findEntryData(const unsigned char* data, size_t size, const Entry& entry);
+    
+    /**
+     * 展開先として安全なファイル名かどうか (絶対パスや .. を含まない)
+     */
+    bool isSafeFilename(const std::string& filename);
+    
+    /**
+     * 圧縮されたデータを少しずつ展開する
+     */
+    class Decompressor
+    {
+    public:
+        CC_DISALLOW_COPY_AND_ASSIGN(Decompressor);
+        
+        /// 展開したデータの出力先。false を返すと展開を中断する
+        typedef std::function<bool(const unsigned char* data, size_t size)> Output;
+        
+        explicit Decompressor(uint16_t method);
+        ~Decompressor();
+        
+        /**
+         * 対応している圧縮方式かどうか
+         */
+        bool isSupported() const { return _supported; }
+        
+        /**
+         * 圧縮方式が、データの終わりを自身で判断できるかどうか
+         */
+        bool isSelfTerminating() const { return _method != METHOD_STORED; }
+        
+        /**
+         * 入力を展開して output へ渡す
+         * @param outConsumed 使用した入力のバイト数
+         * @return 壊れたデータであるか、output が false を返したら false
+         */
+        bool update(const unsigned char* data, size_t size, size_t& outConsumed, const Output& output);
+        
+        /**
+         * データの終わりまで展開したかどうか (データの終わりを自身で判断できる場合のみ)
+         */
+        bool isFinished() const { return _finished; }
+    
+    private:
+#if CC_ZIP_USE_ZSTD
+        bool updateZstd(const unsigned char* data, size_t size, size_t& outConsumed, const Output& output);
+#endif
+        
+        const uint16_t _method;
+        bool _supported;
+        bool _finished;
+        void* _stream;
+        std::vector<unsigned char> _buffer;
+    };
+    
+    /**
+     * zipファイル全体から、エントリを展開して output へ渡す
+     * 別々のエントリであれば、複数のスレッドから同時に呼び出せる
+     * @return 壊れたデータであるか、CRCが一致しないか、output が false を返したら false
+     */
+    bool extract(const unsigned char* data, size_t size, const Entry& entry, const Decompressor::Output& output);
+    
+    /**
+     * ファイルを読み込み専用でメモリマップする
+     * 大きなzipファイルを、メモリへ読み込まずに扱うために使う
+     */
+    class MappedFile
+    {
+    public:
+        CC_DISALLOW_COPY_AND_ASSIGN(MappedFile);
+        
+        MappedFile();
+        ~MappedFile();
+        
+        /**
+         * @return 開けなかったか、空のファイルであれば false
+         */
+        bool open(const std::string& path);
+        void close();
+        
+        const unsigned char* getData() const { return static_cast<const unsigned char*>(_data); }
+        size_t getSize() const { return _size; }
+        
+        /**
+         * 全てのページを読み込ませておき、後から触れるスレッドでページフォルトが起きないようにする
+         */
+        void prefetch() const;
+    
+    private:
+        void* _data;
+        size_t _size;
+    };
+}
+
+NS_CC_EXT_END
+
+#endif
@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+"""
+ZipDownloader / ZipFileSystem 向けのzipファイルを作成する
+
+  python3 tools/zippack.py out.zip assets/ --method zstd --level 19
+
+--method zstd では各ファイルを zstd (method 93) で圧縮する。
+展開する側では CC_ZIP_USE_ZSTD を 1 で定義し、zstd をリンクしておくこと。
+圧縮しても小さくならないファイルは無圧縮 (method 0) で格納する。
+zstd の圧縮には python の zstandard モジュールか、zstd コマンドを使う。
+"""
+import argparse
+import os
+import struct
+import subprocess
+import sys
+import zlib
+
+METHOD_STORED = 0
+METHOD_DEFLATED = 8
+METHOD_ZSTD = 93
+
+# 展開に必要なバージョン (APPNOTE 4.4.3)
+VERSION_NEEDED = {METHOD_STORED: 10, METHOD_DEFLATED: 20, METHOD_ZSTD: 63}
+
+# 日時は固定して、同じ入力から同じzipファイルを作る (1980-01-01 00:00)
+DOS_TIME = 0
+DOS_DATE = (0 << 9) | (1 << 5) | 1
+
+
+def compress_deflate(data, level):
+    compressor = zlib.compressobj(level, zlib.DEFLATED, -zlib.MAX_WBITS)
+    return compressor.compress(data) + compressor.flush()
+
+
+def compress_zstd(data, level):
+    try:
+        import zstandard
+        return zstandard.ZstdCompressor(level=level).compress(data)
+    except ImportError:
+        pass
+    args = ['zstd', '-q', '-c', '-%d' % level]
+    if level > 19:
+        args.insert(1, '--ultra')
+    return subprocess.run(args, input=data, stdout=subprocess.PIPE, check=True).stdout
+
+
+def compress(data, method, level):
+    if method == METHOD_DEFLATED:
+        return compress_deflate(data, level)
+    if method == METHOD_ZSTD:
+        return compress_zstd(data, level)
+    return data
+
+
+def collect(inputs):
+    """(zip内のファイル名, 元のパス) を、ファイル名順に返す"""
+    files = []
+    for path in inputs:
+        if os.path.isfile(path):
+            files.append((os.path.basename(path), path))
+            continue
+        for root, dirs, names in os.walk(path):
+            dirs.sort()
+            for name in names:
+                full = os.path.join(root, name)
+                files.append((os.path.relpath(full, path).replace(os.sep, '/'), full))
+    return sorted(files)
+
+
+def pack(out, inputs, method, level):
+    entries = []
+    total_in = 0
+    with open(out, 'wb') as f:
+        for filename, path in collect(inputs):
+            with open(path, 'rb') as src:
+                data = src.read()
+            crc = zlib.crc32(data) & 0xffffffff
+            entry_method = method
+            compressed = compress(data, method, level)
+            if len(compressed) >= len(data):
+                entry_method = METHOD_STORED
+                compressed = data
+            if len(data) > 0xffffffff or f.tell() > 0xffffffff:
+                sys.exit('zip64 is not supported: %s' % filename)
+
+            name = filename.encode('utf-8')
+            offset = f.tell()
+            # UTF-8 のファイル名 (bit 11)
+            flags = 0x0800
+            f.write(struct.pack('<IHHHHHIIIHH', 0x04034b50, VERSION_NEEDED[entry_method], flags, entry_method,
+                                DOS_TIME, DOS_DATE, crc, len(compressed), len(data), len(name), 0))
+            f.write(name)
+            f.write(compressed)
+            entries.append((name, flags, entry_method, crc, len(compressed), len(data), offset))
+            total_in += len(data)
+
+        directory_offset = f.tell()
+        for name, flags, entry_method, crc, compressed_size, size, offset in entries:
+            f.write(struct.pack('<IHHHHHHIIIHHHHHII', 0x02014b50, (3 << 8) | 63, VERSION_NEEDED[entry_method], flags,
+                                entry_method, DOS_TIME, DOS_DATE, crc, compressed_size, size, len(name), 0, 0, 0, 0,
+                                0o100644 << 16, offset))
+            f.write(name)
+        directory_size = f.tell() - directory_offset
+        if len(entries) > 0xffff:
+            sys.exit('too many files for zip32: %d' % len(entries))
+        f.write(struct.pack('<IHHHHIIH', 0x06054b50, 0, 0, len(entries), len(entries),
+                            directory_size, directory_offset, 0))
+        total_out = f.tell()
+
+    print('%s: %d files, %d -> %d bytes (%.1f%%)' % (out, len(entries), total_in, total_out,
+                                                     100.0 * total_out / max(1, total_in)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('output', help='作成するzipファイル')
+    parser.add_argument('inputs', nargs='+', help='格納するファイルかディレクトリ (ディレクトリは中身をルートに置く)')
+    parser.add_argument('--method', choices=['stored', 'deflate', 'zstd'], default='zstd')
+    parser.add_argument('--level', type=int, default=None, help='圧縮レベル (default: deflate 9, zstd 19)')
+    args = parser.parse_args()
+
+    method = {'stored': METHOD_STORED, 'deflate': METHOD_DEFLATED, 'zstd': METHOD_ZSTD}[args.method]
+    level = args.level
+    if level is None:
+        level = 19 if method == METHOD_ZSTD else 9
+    pack(args.output, args.inputs, method, level)
+
+
+if __name__ == '__main__':
+    main()